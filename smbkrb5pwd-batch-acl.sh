@@ -0,0 +1,149 @@
+#!/bin/sh
+#
+# smbkrb5pwd-batch-acl.sh - Check that the batch password modify
+# extended operation applies the access control of every entry.
+#
+#	smbkrb5pwd-batch-acl.sh -b ou=test,dc=example,dc=org -w secret
+#
+# The entries uid=batch0 and uid=batch1 below the base must exist with
+# the password given by -w, and the database must let users write only
+# their own userPassword, e.g.
+#
+#	access to attrs=userPassword
+#		by self write
+#		by anonymous auth
+#		by * none
+#
+# It checks that
+#  - an anonymous request is refused as a whole (strongAuthRequired),
+#  - batch0 changing batch0 and batch1 gets success for itself and
+#    insufficientAccess for batch1, whose password still works.
+# The password of batch0 is set back at the end. Exit 0 means all
+# checks passed.
+
+uri=ldap://localhost/
+base=
+pw=
+
+usage()
+{
+	echo "usage: $0 -b base -w password [-H uri]" >&2
+	exit 2
+}
+
+while getopts H:b:w: opt; do
+	case $opt in
+	H) uri=$OPTARG ;;
+	b) base=$OPTARG ;;
+	w) pw=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+[ -n "$base" ] && [ -n "$pw" ] || usage
+
+oid=1.3.6.1.4.1.4203.666.11.13.3
+dn0="uid=batch0,$base"
+dn1="uid=batch1,$base"
+newpw="batch-acl-$$"
+bad=0
+
+hex()
+{
+	printf '%s' "$1" | od -An -tx1 -v | tr -d ' \n'
+}
+
+# BER element with the tag $1 around the contents $2, both in hex
+tlv()
+{
+	n=$(( ${#2} / 2 ))
+	if [ $n -lt 128 ]; then
+		printf '%s%02x%s' "$1" $n "$2"
+	elif [ $n -lt 256 ]; then
+		printf '%s81%02x%s' "$1" $n "$2"
+	else
+		printf '%s82%04x%s' "$1" $n "$2"
+	fi
+}
+
+# base64 of the request value for the pairs "dn password ..."
+request()
+{
+	body=
+	while [ $# -ge 2 ]; do
+		body=$body$(tlv 30 "$(tlv 04 "$(hex "$1")")$(tlv 04 "$(hex "$2")")")
+		shift 2
+	done
+	tlv 30 "$body" | LC_ALL=C awk 'BEGIN { h = "0123456789abcdef" }
+	{
+		for (i = 1; i < length($0); i += 2) {
+			c = (index(h, substr($0, i, 1)) - 1) * 16
+			printf "%c", c + index(h, substr($0, i + 1, 1)) - 1
+		}
+	}' | base64 | tr -d '\n'
+}
+
+# The result codes of the response printed by ldapexop, one per line
+results()
+{
+	awk '/^data::/ { d = 1; sub(/^data:: */, ""); printf "%s", $0; next }
+	     d && /^ / { sub(/^ /, ""); printf "%s", $0; next }
+	     { d = 0 }' | base64 -d | od -An -tu1 -v |
+	awk 'function len(  l, k) {
+		l = b[p++]
+		if (l < 128)
+			return l
+		k = l - 128
+		for (l = 0; k > 0; k--)
+			l = l * 256 + b[p++]
+		return l
+	}
+	{ for (i = 1; i <= NF; i++) b[n++] = $i }
+	END {
+		p = 1; len()			# SEQUENCE OF
+		while (p < n) {
+			p++; len()		# SEQUENCE
+			p++; l = len()		# resultCode
+			for (v = 0; l > 0; l--)
+				v = v * 256 + b[p++]
+			print v
+			p++; p += len()		# diagnosticMessage
+		}
+	}'
+}
+
+check()
+{
+	if [ "$2" = "$3" ]; then
+		echo "ok: $1"
+	else
+		echo "FAIL: $1: got '$2', expected '$3'"
+		bad=1
+	fi
+}
+
+# anonymous
+out=$(ldapexop -x -H "$uri" "$oid::$(request "$dn0" "$newpw" "$dn1" "$newpw")" 2>&1)
+case $out in
+*"(8)"*) got=8 ;;
+*) got=$out ;;
+esac
+check "anonymous request" "$got" 8
+
+# batch0 for itself and batch1
+out=$(ldapexop -x -H "$uri" -D "$dn0" -w "$pw" \
+	"$oid::$(request "$dn0" "$newpw" "$dn1" "$newpw")")
+check "batch0 for batch0 and batch1" "$(echo "$out" | results | tr '\n' ' ')" "0 50 "
+
+ldapwhoami -x -H "$uri" -D "$dn1" -w "$pw" >/dev/null 2>&1
+check "old password of batch1" $? 0
+
+if ldapwhoami -x -H "$uri" -D "$dn0" -w "$newpw" >/dev/null 2>&1; then
+	check "new password of batch0" 0 0
+	ldappasswd -x -H "$uri" -D "$dn0" -w "$newpw" -s "$pw" >/dev/null ||
+		echo "$0: could not set the password of $dn0 back" >&2
+else
+	check "new password of batch0" 1 0
+fi
+
+exit $bad
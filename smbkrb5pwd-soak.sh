@@ -0,0 +1,185 @@
+#!/bin/sh
+#
+# smbkrb5pwd-soak.sh - Drive password changes through slapd for hours and
+# fail if its memory, file descriptors, helper processes or latency drift
+# upwards.
+#
+#	smbkrb5pwd-soak.sh -D cn=admin,dc=example,dc=org -w secret \
+#		-b ou=soak,dc=example,dc=org -n 1000 -c 8 -t 14400
+#
+# The entries uid=soak0 .. uid=soak<n-1> below the base must exist. The
+# overlay is meant to be built with DEFS=-DSMBKRB5PWD_FAULT and slapd
+# started with e.g. SMBKRB5PWD_FAULT="stub delay=20 error=1 hang=0.1
+# crash=0.1", so that no kadmind is needed and helpers fail, hang and
+# die along the way; see FAULT INJECTION AND SOAK RUNS in the README.
+#
+# Every interval a line "time,rss_kb,fds,children,zombies,changes,errors,
+# p99_us" is appended to the output file. At the end the samples after
+# the warmup are fitted with a straight line; the run fails (exit 1) if
+# over the run RSS grew by more than -R percent, descriptors by more than
+# -F, p99 by more than -P percent, if zombies stayed for two samples or
+# if the number of helpers changed.
+
+uri=ldap://localhost/
+binddn=
+bindpw=
+base=
+users=100
+workers=4
+duration=3600
+interval=60
+warmup=2
+pid=
+out=smbkrb5pwd-soak.csv
+rss_pct=10
+fd_max=5
+p99_pct=50
+
+usage()
+{
+	echo "usage: $0 -D binddn -w password -b base [-H uri] [-n users]" \
+	     "[-c workers] [-t seconds] [-i interval] [-W warmup samples]" \
+	     "[-p slapd pid] [-o file] [-R rss %] [-F fds] [-P p99 %]" >&2
+	exit 2
+}
+
+while getopts H:D:w:b:n:c:t:i:W:p:o:R:F:P: opt; do
+	case $opt in
+	H) uri=$OPTARG ;;
+	D) binddn=$OPTARG ;;
+	w) bindpw=$OPTARG ;;
+	b) base=$OPTARG ;;
+	n) users=$OPTARG ;;
+	c) workers=$OPTARG ;;
+	t) duration=$OPTARG ;;
+	i) interval=$OPTARG ;;
+	W) warmup=$OPTARG ;;
+	p) pid=$OPTARG ;;
+	o) out=$OPTARG ;;
+	R) rss_pct=$OPTARG ;;
+	F) fd_max=$OPTARG ;;
+	P) p99_pct=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+[ -n "$binddn" ] && [ -n "$bindpw" ] && [ -n "$base" ] || usage
+[ -n "$pid" ] || pid=$(pidof -s slapd)
+if [ -z "$pid" ] || [ ! -d /proc/$pid ]; then
+	echo "$0: slapd is not running" >&2
+	exit 2
+fi
+
+tmp=$(mktemp -d) || exit 2
+trap 'kill $wpids 2>/dev/null; rm -rf "$tmp"' EXIT
+trap 'exit 1' INT TERM
+
+# One change per line of $tmp/lat: microseconds and ldappasswd status
+worker()
+{
+	n=0
+	while [ ! -e "$tmp/stop" ]; do
+		n=$((n + 1))
+		dn="uid=soak$(( (n * 7919 + $1 * 104729) % users )),$base"
+		t0=$(date +%s%N)
+		ldappasswd -x -H "$uri" -D "$binddn" -w "$bindpw" \
+			-s "soak-$1-$n-$t0" "$dn" >/dev/null 2>&1
+		rc=$?
+		t1=$(date +%s%N)
+		echo "$(( (t1 - t0) / 1000 )) $rc" >>"$tmp/lat"
+	done
+}
+
+sample()
+{
+	rss=$(awk '/^VmRSS:/ { print $2 }' /proc/$pid/status)
+	fds=$(ls /proc/$pid/fd | wc -l)
+	children=$(ps -o stat= --ppid $pid | wc -l)
+	zombies=$(ps -o stat= --ppid $pid | grep -c '^Z')
+
+	: >>"$tmp/lat"
+	mv "$tmp/lat" "$tmp/lat.last"
+	changes=$(wc -l <"$tmp/lat.last")
+	errors=$(awk '$2 != 0' "$tmp/lat.last" | wc -l)
+	p99=$(awk '{ print $1 }' "$tmp/lat.last" | sort -n |
+		awk '{ v[NR] = $1 }
+		     END { i = int(NR * 0.99); if (i < 1) i = NR;
+			   print NR ? v[i] : 0 }')
+
+	echo "$(date +%s),$rss,$fds,$children,$zombies,$changes,$errors,$p99" |
+		tee -a "$out"
+}
+
+echo "time,rss_kb,fds,children,zombies,changes,errors,p99_us" >"$out"
+
+i=0
+wpids=
+while [ $i -lt "$workers" ]; do
+	worker $i &
+	wpids="$wpids $!"
+	i=$((i + 1))
+done
+
+end=$(( $(date +%s) + duration ))
+while [ "$(date +%s)" -lt $end ]; do
+	sleep "$interval"
+	if [ ! -d /proc/$pid ]; then
+		echo "FAIL: slapd exited" >&2
+		exit 1
+	fi
+	sample
+done
+
+touch "$tmp/stop"
+wait $wpids
+wpids=
+
+awk -F, -v warmup="$warmup" -v rss_pct="$rss_pct" -v fd_max="$fd_max" \
+    -v p99_pct="$p99_pct" '
+function fit(col, name) {
+	n = sx = sy = sxx = sxy = 0
+	for (i = warmup + 1; i <= rows; i++) {
+		n++; sx += t[i]; sy += v[i, col]
+		sxx += t[i] * t[i]; sxy += t[i] * v[i, col]
+	}
+	if (n < 2 || n * sxx == sx * sx)
+		return 0
+	slope = (n * sxy - sx * sy) / (n * sxx - sx * sx)
+	mean = sy / n
+	growth = slope * (t[rows] - t[warmup + 1])
+	printf "%s: mean %.0f, %+.0f over the run\n", name, mean, growth
+	return growth
+}
+NR == 2 {
+	t0 = $1
+}
+NR > 1 {
+	rows++
+	t[rows] = $1 - t0
+	for (c = 2; c <= 8; c++)
+		v[rows, c] = $c
+	if ($5 > 0 && zombie_prev > 0)
+		zombied = 1
+	zombie_prev = $5
+}
+END {
+	if (rows - warmup < 3) {
+		print "FAIL: too few samples after the warmup"
+		exit 1
+	}
+	g = fit(2, "rss_kb")
+	if (g > mean * rss_pct / 100) { print "FAIL: RSS grows"; bad = 1 }
+	g = fit(3, "fds")
+	if (g > fd_max) { print "FAIL: file descriptors leak"; bad = 1 }
+	g = fit(8, "p99_us")
+	if (g > mean * p99_pct / 100) { print "FAIL: p99 latency grows"; bad = 1 }
+	if (zombied) { print "FAIL: helpers stayed zombies"; bad = 1 }
+	if (v[rows, 4] != v[warmup + 1, 4]) {
+		printf "FAIL: %d helpers, %d after the warmup\n",
+			v[rows, 4], v[warmup + 1, 4]
+		bad = 1
+	}
+	if (!bad)
+		print "PASS"
+	exit bad
+}' "$out"
@@ -0,0 +1,137 @@
+/* smbkrb5pwd-trace.c - Decoder for smbkrb5pwd flight recorder files */
+/* This work is part of OpenLDAP Software <http://www.openldap.org/>.
+ *
+ * Copyright 2004-2009 The OpenLDAP Foundation.
+ * Other portions Copyright 2010 Opinsys.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+/* Usage: smbkrb5pwd-trace [-j] [file ...]
+ *
+ * Prints the events of olcSmbKrb5PwdTraceFile as text, or with -j as
+ * one JSON object per line. Reads standard input if no file is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smbkrb5pwd_trace.h"
+
+static const char *phases[] = SMBKRB5PWD_PHASE_NAMES;
+
+static const char *
+phase_name(unsigned phase)
+{
+	if (phase > SMBKRB5PWD_PH_MAX)
+		phase = 0;
+	return phases[phase];
+}
+
+static void
+print_event(const smbkrb5pwd_trace_event *ev, int json)
+{
+	char tbuf[32];
+	time_t sec = ev->ev_time / 1000000000ULL;
+	unsigned long usec = (ev->ev_time % 1000000000ULL) / 1000;
+	struct tm tm;
+
+	gmtime_r(&sec, &tm);
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	if (json) {
+		printf("{\"time\":\"%s.%06luZ\",\"conn\":%llu,\"op\":%llu,"
+		       "\"pid\":%u,\"phase\":\"%s\",\"duration_us\":%u,"
+		       "\"kadm5\":%d,\"rc\":%d,\"error\":%s}\n",
+		       tbuf, usec,
+		       (unsigned long long)ev->ev_connid,
+		       (unsigned long long)ev->ev_opid,
+		       ev->ev_pid, phase_name(ev->ev_phase),
+		       ev->ev_duration, ev->ev_kadm5, ev->ev_rc,
+		       (ev->ev_flags & SMBKRB5PWD_EV_ERROR) ?
+		       "true" : "false");
+	} else {
+		printf("%s.%06luZ conn=%llu op=%llu pid=%u %-12s %10uus"
+		       " kadm5=%d rc=%d%s\n",
+		       tbuf, usec,
+		       (unsigned long long)ev->ev_connid,
+		       (unsigned long long)ev->ev_opid,
+		       ev->ev_pid, phase_name(ev->ev_phase),
+		       ev->ev_duration, ev->ev_kadm5, ev->ev_rc,
+		       (ev->ev_flags & SMBKRB5PWD_EV_ERROR) ?
+		       " ERROR" : "");
+	}
+}
+
+static int
+decode(FILE *fp, const char *name, int json)
+{
+	smbkrb5pwd_trace_event ev;
+	unsigned long n = 0;
+	size_t len;
+
+	while ((len = fread(&ev, 1, sizeof(ev), fp)) == sizeof(ev)) {
+		if (ev.ev_magic != SMBKRB5PWD_TRACE_MAGIC) {
+			fprintf(stderr, "%s: bad record %lu, "
+				"not a smbkrb5pwd trace file?\n", name, n);
+			return 1;
+		}
+		print_event(&ev, json);
+		n++;
+	}
+
+	if (ferror(fp)) {
+		perror(name);
+		return 1;
+	}
+
+	if (len != 0) {
+		fprintf(stderr, "%s: truncated record %lu\n", name, n);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *fp;
+	int i, opt, json = 0, rc = 0;
+
+	while ((opt = getopt(argc, argv, "j")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-j] [file ...]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind == argc)
+		return decode(stdin, "-", json);
+
+	for (i = optind; i < argc; i++) {
+		if ((fp = fopen(argv[i], "rb")) == NULL) {
+			perror(argv[i]);
+			rc = 1;
+			continue;
+		}
+		rc |= decode(fp, argv[i], json);
+		fclose(fp);
+	}
+
+	return rc;
+}
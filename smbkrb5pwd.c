@@ -27,8 +27,16 @@
 
 #include <netdb.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #ifndef SLAPD_OVER_SMBKRB5PWD
 #define SLAPD_OVER_SMBKRB5PWD SLAPD_MOD_DYNAMIC
@@ -47,6 +55,31 @@
 #include <krb5/krb5.h>
 #include <kadm5/admin.h>
 
+#ifdef SMBKRB5PWD_KADM5_SRV
+#include <kdb.h>
+
+/* The krbPrincipalKey codec of libkrb5, used by the LDAP KDB plugin but
+ * not declared in the installed headers. See smbkrb5pwd_helper_keys(). */
+typedef struct smbkrb5pwd_seqof_key_data {
+	krb5_int32	mkvno;
+	krb5_int32	kvno;
+	krb5_key_data	*key_data;
+	krb5_int16	n_key_data;
+} smbkrb5pwd_seqof_key_data;
+
+extern krb5_error_code krb5int_ldap_encode_sequence_of_keys(
+	const smbkrb5pwd_seqof_key_data *val, krb5_data **code );
+extern krb5_error_code krb5int_ldap_decode_sequence_of_keys(
+	const krb5_data *in, smbkrb5pwd_seqof_key_data **rep );
+#endif
+
+#ifdef SLAPD_MONITOR
+#define SMBKRB5PWD_MONITOR
+#include "back-monitor/back-monitor.h"
+#endif
+
+#include "smbkrb5pwd_trace.h"
+
 #define KRB5_KEYTAB "/etc/ldap/slapd.d/openldap-krb5.keytab"
 
 static AttributeDescription *ad_objectclass;
@@ -59,6 +92,9 @@ typedef unsigned char DES_cblock[8];
 #else
 #include <openssl/des.h>
 #include <openssl/md4.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #endif
 #include "ldap_utf8.h"
 
@@ -68,6 +104,137 @@ static AttributeDescription *ad_sambaPwdMustChange;
 static AttributeDescription *ad_sambaPwdCanChange;
 static ObjectClass *oc_sambaSamAccount;
 
+/* Credential generation marker, see smbkrb5pwd_bind()
+ * NOTE: uses the experimental OID arc 1.3.6.1.4.1.4203.666.11.13.4 */
+static AttributeDescription *ad_smbkrb5pwdCredVersion;
+static char *smbkrb5pwd_cred_version_at =
+	"( 1.3.6.1.4.1.4203.666.11.13.4.1 "
+	"NAME 'smbkrb5pwdCredVersion' "
+	"DESC 'olcSmbKrb5PwdCredGeneration of the last password change' "
+	"EQUALITY integerMatch "
+	"ORDERING integerOrderingMatch "
+	"SYNTAX 1.3.6.1.4.1.1466.115.121.1.27 "
+	"SINGLE-VALUE "
+	"NO-USER-MODIFICATION "
+	"USAGE directoryOperation )";
+
+#ifdef SMBKRB5PWD_KADM5_SRV
+/* LDAP KDB schema, for olcSmbKrb5PwdKrb5Inline */
+static AttributeDescription *ad_krbPrincipalName;
+static AttributeDescription *ad_krbPrincipalKey;
+static AttributeDescription *ad_krbLastPwdChange;
+static AttributeDescription *ad_krbPasswordExpiration;
+static AttributeDescription *ad_krbPwdPolicyReference;
+static AttributeDescription *ad_krbMaxPwdLife;
+static AttributeDescription *ad_krbMinPwdLife;
+static AttributeDescription *ad_krbMinPwdLength;
+static AttributeDescription *ad_krbMinPwdClasses;
+static AttributeDescription *ad_krbPwdHistoryLength;
+static AttributeDescription *ad_krbPwdAllowedKeysalts;	/* optional */
+static ObjectClass *oc_krbPrincipalAux;
+#endif
+
+typedef struct smbkrb5pwd_pool smbkrb5pwd_pool;
+
+/* A kerberos realm with its own admin principal, helper processes and
+ * readiness, so that a slow KDC only delays the changes of its realm */
+typedef struct smbkrb5pwd_realm {
+	struct smbkrb5pwd_t	*rm_pi;
+	char			*rm_name;
+	char			*rm_admin_princstr;
+	char			*rm_admin_server;	/* NULL: krb5.conf */
+
+	/* Readiness of the realm, protected by krb5_mutex of rm_pi.
+	 * Resolving the admin principal and checking the keytab is done
+	 * by smbkrb5pwd_prewarm() in the background after db_open. */
+	int			rm_state;
+#define	SMBKRB5PWD_S_COLD	0
+#define	SMBKRB5PWD_S_WARMING	1
+#define	SMBKRB5PWD_S_READY	2
+	struct re_s		*rm_prewarm_task;
+
+	/* Kerberos helper processes, see smbkrb5pwd_pool_start() */
+	smbkrb5pwd_pool		*rm_pool;
+} smbkrb5pwd_realm;
+
+/* A value of olcSmbKrb5PwdRealmMap */
+typedef struct smbkrb5pwd_realm_map {
+	struct berval		mp_realm;
+	struct berval		mp_base;	/* empty: only by realm_attr */
+	struct berval		mp_nbase;
+} smbkrb5pwd_realm_map;
+
+/* Entries below rt_ndn are changed in rt_realm */
+typedef struct smbkrb5pwd_route {
+	struct berval		rt_ndn;
+	smbkrb5pwd_realm	*rt_realm;
+} smbkrb5pwd_route;
+
+/* A compiled olcSmbKrb5PwdPrincipal, see smbkrb5pwd_princ_compile() */
+typedef struct smbkrb5pwd_princ_op {
+	int			po_type;
+#define SMBKRB5PWD_PO_TEXT	0
+#define SMBKRB5PWD_PO_ATTR	1
+#define SMBKRB5PWD_PO_REALM	2
+	int			po_flags;
+#define SMBKRB5PWD_PO_LOWER	0x1	/* ASCII lower case */
+#define SMBKRB5PWD_PO_LOCAL	0x2	/* up to the first '@' */
+	AttributeDescription	*po_ad;
+	struct berval		po_text;	/* in pm_template */
+} smbkrb5pwd_princ_op;
+
+typedef struct smbkrb5pwd_princ_map {
+	char			*pm_template;
+	int			pm_nops;
+	smbkrb5pwd_princ_op	pm_ops[ 1 ];
+} smbkrb5pwd_princ_map;
+
+#define SMBKRB5PWD_PRINC_DEFAULT	"%{uid}@%{realm}"
+
+/* Latency and errors of the kerberos changes of one side of the shadow
+ * comparison, see smbkrb5pwd_shadow_stat() */
+#define SMBKRB5PWD_SHADOW_PRIMARY	0
+#define SMBKRB5PWD_SHADOW_SECONDARY	1
+#define SMBKRB5PWD_SHADOW_BUCKETS	32
+
+typedef struct smbkrb5pwd_shadow_stats {
+	unsigned long		ss_changes;
+	unsigned long		ss_errors;
+	unsigned long long	ss_usec;	/* sum */
+	unsigned long		ss_max;
+	/* changes by the log2 of their microseconds */
+	unsigned long		ss_hist[ SMBKRB5PWD_SHADOW_BUCKETS ];
+} smbkrb5pwd_shadow_stats;
+
+/* A recently applied kerberos change, see smbkrb5pwd_dedupe_find().
+ * Only keyed MACs are kept, never the principal or the password. */
+#define SMBKRB5PWD_MAC_LEN	32	/* HMAC-SHA256 */
+
+typedef struct smbkrb5pwd_dedupe_ent {
+	unsigned char		de_princ[ SMBKRB5PWD_MAC_LEN ];
+	unsigned char		de_change[ SMBKRB5PWD_MAC_LEN ];
+	time_t			de_expires;
+} smbkrb5pwd_dedupe_ent;
+
+/* The settings read by operations, published by smbkrb5pwd_conf_publish()
+ * and never changed afterwards; see smbkrb5pwd_conf_get() */
+typedef struct smbkrb5pwd_conf {
+	unsigned		mode;
+	time_t			smb_must_change;
+	time_t			smb_can_change;
+	ObjectClass		*oc_requiredObjectclass;
+	int			keep_sasl_id;
+	AttributeDescription	*realm_attr;
+	int			krb5_inline;
+	int			cred_generation;
+	int			upgrade_rate;
+	int			shadow_max;
+	int			dedupe_ttl;
+	smbkrb5pwd_princ_map	*princ_map;
+	char			*trace_file;
+	int			trace_slow;
+} smbkrb5pwd_conf;
+
 /* Per-instance configuration information */
 typedef struct smbkrb5pwd_t {
 	unsigned	mode;
@@ -82,12 +249,154 @@ typedef struct smbkrb5pwd_t {
 	/* How many seconds after allowing a password change? */
 	time_t  smb_can_change;
 	char    *kerberos_realm;
-	char    *admin_princstr;
 	ldap_pvt_thread_mutex_t krb5_mutex;
+	/* olcSmbKrb5PwdPrincipal; replaced ones are freed under the pause
+	 * like the snapshots that point to them */
+	smbkrb5pwd_princ_map	*princ_map;
 	ObjectClass *oc_requiredObjectclass;
 	int     keep_sasl_id;
+	BackendDB	*be;
+
+	/* Realm routing, olcSmbKrb5PwdRealmMap and olcSmbKrb5PwdRealmAttr.
+	 * They are compiled by smbkrb5pwd_realms_open() into the realms
+	 * sorted by name and the routes sorted from the deepest base up;
+	 * the default realm is olcSmbKrb5PwdKrb5Realm. */
+	smbkrb5pwd_realm_map	*realm_maps;
+	int			nrealm_maps;
+	AttributeDescription	*realm_attr;
+	smbkrb5pwd_realm	**realms;
+	int			nrealms;
+	smbkrb5pwd_route	*routes;
+	int			nroutes;
+	smbkrb5pwd_realm	*default_realm;
+
+	/* Re-stamping of sambaPwdMustChange/CanChange after the intervals
+	 * changed, see smbkrb5pwd_restamp() */
+	int		restamp;
+	int		restamp_batch;
+	int		restamp_interval;
+	int		restamp_gen;	/* bumped when the intervals change */
+	struct re_s	*restamp_task;
+	struct smbkrb5pwd_restamp_ent	*restamp_ents;
+	int		restamp_num;
+	int		restamp_next;
+	int		restamp_scanned;	/* restamp_gen of restamp_ents */
+	time_t		restamp_must;
+	time_t		restamp_can;
+	/* progress, protected by krb5_mutex */
+	int		restamp_state;
+#define	SMBKRB5PWD_R_IDLE	0
+#define	SMBKRB5PWD_R_SCANNING	1
+#define	SMBKRB5PWD_R_WRITING	2
+#define	SMBKRB5PWD_R_DONE	3
+	unsigned long	restamp_total;
+	unsigned long	restamp_done;
+	unsigned long	restamp_failed;
+
+	/* Kerberos helper processes per realm, and how many of them the
+	 * lower priority lanes may use, see smbkrb5pwd_pool_caps() */
+	int		helpers;
+	int		bulk_helpers;		/* 0: all but one */
+	int		background_helpers;	/* 0: one */
+
+	/* Derive the keys of LDAP KDB principals in the helpers and write
+	 * them with the password modify, see krb5_set_passwd(). Only used
+	 * once krb5_inline_basic acknowledges that such changes skip the
+	 * kadm5 dictionary and pwqual checks. */
+	int		krb5_inline;
+	int		krb5_inline_basic;
+
+	/* Credential upgrade on simple bind, see smbkrb5pwd_bind() */
+	int		cred_generation;
+	int		upgrade_rate;		/* per hour */
+	struct re_s	*upgrade_task;
+	/* protected by krb5_mutex */
+	struct smbkrb5pwd_upgrade_ent	*upgrade_queue;
+	struct smbkrb5pwd_upgrade_ent	**upgrade_tail;
+	int		upgrade_nqueue;
+	unsigned long long	upgrade_next;	/* ms, earliest next upgrade */
+	unsigned long	upgrade_queued;
+	unsigned long	upgrade_done;
+	unsigned long	upgrade_failed;
+	unsigned long	upgrade_skipped;
+
+	/* Mirroring of kerberos changes to a shadow realm or admin
+	 * server, see smbkrb5pwd_shadow() */
+	char		*shadow_name;
+	char		*shadow_server;
+	int		shadow_max;		/* queue length */
+	smbkrb5pwd_realm	*shadow_realm;
+	struct re_s	*shadow_task;
+	/* protected by krb5_mutex */
+	struct smbkrb5pwd_shadow_ent	*shadow_queue;
+	struct smbkrb5pwd_shadow_ent	**shadow_tail;
+	int		shadow_nqueue;
+	unsigned long	shadow_dropped;
+	smbkrb5pwd_shadow_stats	shadow_stats[ 2 ];
+
+	/* Recently applied kerberos changes, so that a client retrying a
+	 * change it timed out on does not repeat it in kerberos, see
+	 * smbkrb5pwd_dedupe_find(). The table and its key are replaced by
+	 * smbkrb5pwd_dedupe_reset() only under the pause. */
+	int		dedupe_ttl;		/* seconds, 0: off */
+	int		dedupe_size;
+	smbkrb5pwd_dedupe_ent	*dedupe;
+	unsigned char	dedupe_key[ SMBKRB5PWD_MAC_LEN ];
+	/* protected by krb5_mutex, as are the entries */
+	unsigned long	dedupe_hits;
+	unsigned long	dedupe_misses;
+
+	/* Flight recorder, see smbkrb5pwd_trace() */
+	char	*trace_file;
+	int	trace_slow;
+
+	/* The fields above are staged by smbkrb5pwd_cf_func(); operations
+	 * only read the last snapshot of them */
+	smbkrb5pwd_conf	*conf;
+#ifdef SMBKRB5PWD_MONITOR
+	struct berval	monitor_ndn;
+	void		*monitor_cb;
+#endif
 } smbkrb5pwd_t;
 
+static const char *smbkrb5pwd_states[] = {
+	"cold",
+	"warming",
+	"ready",
+};
+
+static const char *smbkrb5pwd_restamp_states[] = {
+	"idle",
+	"scanning",
+	"writing",
+	"done",
+};
+
+/* Defaults of olcSmbKrb5PwdRestampBatch and olcSmbKrb5PwdRestampInterval */
+#define SMBKRB5PWD_RESTAMP_BATCH	500
+#define SMBKRB5PWD_RESTAMP_INTERVAL	1
+
+/* Seconds between retries when the prewarm phase fails */
+#define SMBKRB5PWD_PREWARM_RETRY	30
+
+/* Default of olcSmbKrb5PwdTraceSlow, in milliseconds */
+#define SMBKRB5PWD_TRACE_SLOW	1000
+
+/* Default of olcSmbKrb5PwdUpgradeRate, upgrades per hour; the queue
+ * length and the seconds between runs of smbkrb5pwd_upgrade() */
+#define SMBKRB5PWD_UPGRADE_RATE		360
+#define SMBKRB5PWD_UPGRADE_QUEUE	32
+#define SMBKRB5PWD_UPGRADE_INTERVAL	1
+
+/* Default of olcSmbKrb5PwdShadowQueue, and the seconds between runs of
+ * smbkrb5pwd_shadow() */
+#define SMBKRB5PWD_SHADOW_QUEUE		256
+#define SMBKRB5PWD_SHADOW_INTERVAL	1
+#define SMBKRB5PWD_SHADOW_CHUNK		16	/* changes submitted at once */
+
+/* Default of olcSmbKrb5PwdDedupeSize */
+#define SMBKRB5PWD_DEDUPE_SIZE		4096
+
 static const unsigned SMBKRB5PWD_F_ALL	=
 	0
 	| SMBKRB5PWD_F_KRB5
@@ -95,6 +404,53 @@ static const unsigned SMBKRB5PWD_F_ALL	=
 ;
 
 static int smbkrb5pwd_modules_init( smbkrb5pwd_t *pi );
+#ifdef SMBKRB5PWD_KADM5_SRV
+static int smbkrb5pwd_inline_init( void );
+#endif
+
+/* Publish the staged settings of pi as a new snapshot.
+ *
+ * Operations load the snapshot once with smbkrb5pwd_conf_get() and use
+ * that copy to the end, so a change never shows half applied and the
+ * exop path takes no lock for its settings. The previous snapshot can
+ * be freed right away: smbkrb5pwd_cf_func() runs while back-config
+ * holds the thread pool paused, or before it starts, which makes it the
+ * grace period after which no operation or runqueue task can still
+ * hold the old pointer. The kerberos helpers keep the copy of the
+ * snapshot they were forked with. */
+static void
+smbkrb5pwd_conf_publish( smbkrb5pwd_t *pi )
+{
+	smbkrb5pwd_conf	*cf, *old;
+
+	cf = ch_calloc( 1, sizeof( smbkrb5pwd_conf ) );
+	cf->mode = pi->mode;
+	cf->smb_must_change = pi->smb_must_change;
+	cf->smb_can_change = pi->smb_can_change;
+	cf->oc_requiredObjectclass = pi->oc_requiredObjectclass;
+	cf->keep_sasl_id = pi->keep_sasl_id;
+	cf->realm_attr = pi->realm_attr;
+	cf->krb5_inline = pi->krb5_inline && pi->krb5_inline_basic;
+	cf->cred_generation = pi->cred_generation;
+	cf->upgrade_rate = pi->upgrade_rate;
+	cf->shadow_max = pi->shadow_max;
+	cf->dedupe_ttl = pi->dedupe_ttl;
+	cf->princ_map = pi->princ_map;
+	cf->trace_file = pi->trace_file ? ch_strdup( pi->trace_file ) : NULL;
+	cf->trace_slow = pi->trace_slow;
+
+	old = __atomic_exchange_n( &pi->conf, cf, __ATOMIC_ACQ_REL );
+	if ( old ) {
+		ch_free( old->trace_file );
+		ch_free( old );
+	}
+}
+
+static smbkrb5pwd_conf *
+smbkrb5pwd_conf_get( smbkrb5pwd_t *pi )
+{
+	return __atomic_load_n( &pi->conf, __ATOMIC_ACQUIRE );
+}
 
 static const char hex[] = "0123456789abcdef";
 
@@ -148,6 +504,222 @@ static void nthash(
 	hexify( hbuf, hash );
 }
 
+/*
+ * Flight recorder: every phase of a password change is recorded as a
+ * fixed size binary event in a ring owned by the slapd thread (or the
+ * forked kadm5 process) that runs it, so recording needs no locks and
+ * no formatting. The events of an operation that fails or is slower
+ * than olcSmbKrb5PwdTraceSlow are appended to olcSmbKrb5PwdTraceFile,
+ * which can be decoded with smbkrb5pwd-trace.
+ */
+#define SMBKRB5PWD_TRACE_RING	256
+
+typedef struct smbkrb5pwd_trace_ring {
+	unsigned		tr_next;
+	smbkrb5pwd_trace_event	tr_events[ SMBKRB5PWD_TRACE_RING ];
+} smbkrb5pwd_trace_ring;
+
+/* only its address is used, as the thread pool key */
+static int smbkrb5pwd_trace_key;
+
+/* kerberos helper processes are single threaded and use this one */
+static smbkrb5pwd_trace_ring *smbkrb5pwd_helper_ring;
+
+static void
+smbkrb5pwd_trace_ring_free( void *key, void *data )
+{
+	ch_free( data );
+}
+
+static smbkrb5pwd_trace_ring *
+smbkrb5pwd_trace_ring_get( Operation *op )
+{
+	void	*data = NULL;
+
+	if ( op == NULL ) {
+		return smbkrb5pwd_helper_ring;
+	}
+
+	if ( op->o_threadctx == NULL ) {
+		return NULL;
+	}
+
+	if ( ldap_pvt_thread_pool_getkey( op->o_threadctx,
+			&smbkrb5pwd_trace_key, &data, NULL ) ) {
+		data = ch_calloc( 1, sizeof( smbkrb5pwd_trace_ring ) );
+		if ( ldap_pvt_thread_pool_setkey( op->o_threadctx,
+				&smbkrb5pwd_trace_key, data,
+				smbkrb5pwd_trace_ring_free, NULL, NULL ) ) {
+			ch_free( data );
+			return NULL;
+		}
+	}
+
+	return (smbkrb5pwd_trace_ring *)data;
+}
+
+/*
+ * USDT probes, built with -DSMBKRB5PWD_USDT (needs sys/sdt.h). Every
+ * phase fires phase__begin(phase, connid, opid, who) where who is the
+ * DN or principal it works on, and phase__end(phase, connid, opid,
+ * start_ns, kadm5_rc, rc) from smbkrb5pwd_trace_ev(). start_ns is the
+ * CLOCK_MONOTONIC start of the phase, the clock of bpftrace's nsecs, so
+ * the end probe alone gives the latency; see smbkrb5pwd-latency.bt. A
+ * probe that is not attached is a nop, without it nothing is built.
+ */
+#ifdef SMBKRB5PWD_USDT
+#include <sys/sdt.h>
+#define SMBKRB5PWD_PROBE_BEGIN( phase, connid, opid, who ) \
+	DTRACE_PROBE4( smbkrb5pwd, phase__begin, (phase), \
+		(unsigned long)(connid), (unsigned long)(opid), (who) )
+#define SMBKRB5PWD_PROBE_END( phase, connid, opid, start, kadm5_rc, rc ) \
+	DTRACE_PROBE6( smbkrb5pwd, phase__end, (phase), \
+		(unsigned long)(connid), (unsigned long)(opid), \
+		(uint64_t)(start)->tv_sec * 1000000000ULL + (start)->tv_nsec, \
+		(long)(kadm5_rc), (rc) )
+#else
+#define SMBKRB5PWD_PROBE_BEGIN( phase, connid, opid, who )
+#define SMBKRB5PWD_PROBE_END( phase, connid, opid, start, kadm5_rc, rc )
+#endif
+
+#define SMBKRB5PWD_PROBE_OP( phase, op, who ) \
+	SMBKRB5PWD_PROBE_BEGIN( (phase), (op)->o_connid, (op)->o_opid, (who) )
+
+static void
+smbkrb5pwd_trace_begin( struct timespec *start )
+{
+	clock_gettime( CLOCK_MONOTONIC, start );
+}
+
+static long
+smbkrb5pwd_trace_elapsed( struct timespec *start )
+{
+	struct timespec	now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+
+	return ( now.tv_sec - start->tv_sec ) * 1000000L
+		+ ( now.tv_nsec - start->tv_nsec ) / 1000L;
+}
+
+/* Record the end of a phase that began at start. op is NULL in the
+ * kerberos helpers, which pass the ids of the request instead. */
+static void
+smbkrb5pwd_trace_ev(
+	smbkrb5pwd_t *pi,
+	Operation *op,
+	unsigned long connid,
+	unsigned long opid,
+	int phase,
+	struct timespec *start,
+	long kadm5_rc,
+	int rc )
+{
+	smbkrb5pwd_trace_ring	*tr;
+	smbkrb5pwd_trace_event	*ev;
+	struct timespec		wall;
+
+	SMBKRB5PWD_PROBE_END( phase, connid, opid, start, kadm5_rc, rc );
+
+	if ( smbkrb5pwd_conf_get( pi )->trace_file == NULL ) {
+		return;
+	}
+
+	tr = smbkrb5pwd_trace_ring_get( op );
+	if ( tr == NULL ) {
+		return;
+	}
+
+	clock_gettime( CLOCK_REALTIME, &wall );
+
+	ev = &tr->tr_events[ tr->tr_next++ % SMBKRB5PWD_TRACE_RING ];
+	ev->ev_magic = SMBKRB5PWD_TRACE_MAGIC;
+	ev->ev_phase = phase;
+	ev->ev_flags = ( rc != LDAP_SUCCESS || kadm5_rc ) ?
+		SMBKRB5PWD_EV_ERROR : 0;
+	ev->ev_time = (uint64_t)wall.tv_sec * 1000000000ULL + wall.tv_nsec;
+	ev->ev_connid = connid;
+	ev->ev_opid = opid;
+	ev->ev_kadm5 = kadm5_rc;
+	ev->ev_rc = rc;
+	ev->ev_duration = smbkrb5pwd_trace_elapsed( start );
+	ev->ev_pid = getpid();
+}
+
+#define smbkrb5pwd_trace( pi, op, phase, start, kadm5_rc, rc ) \
+	smbkrb5pwd_trace_ev( (pi), (op), (op)->o_connid, (op)->o_opid, \
+		(phase), (start), (kadm5_rc), (rc) )
+
+/* Append the events this process recorded for an operation to the
+ * trace file if it failed or took longer than olcSmbKrb5PwdTraceSlow */
+static void
+smbkrb5pwd_trace_done_ev(
+	smbkrb5pwd_t *pi,
+	Operation *op,
+	unsigned long connid,
+	unsigned long opid,
+	struct timespec *start,
+	int rc )
+{
+	smbkrb5pwd_conf		*cf = smbkrb5pwd_conf_get( pi );
+	smbkrb5pwd_trace_ring	*tr;
+	smbkrb5pwd_trace_event	events[ SMBKRB5PWD_TRACE_RING ], *ev;
+	unsigned		i, n = 0;
+	uint32_t		pid;
+	int			fd;
+
+	if ( cf->trace_file == NULL ) {
+		return;
+	}
+
+	if ( rc == LDAP_SUCCESS &&
+	     smbkrb5pwd_trace_elapsed( start ) < cf->trace_slow * 1000L ) {
+		return;
+	}
+
+	tr = smbkrb5pwd_trace_ring_get( op );
+	if ( tr == NULL ) {
+		return;
+	}
+
+	pid = getpid();
+	i = tr->tr_next > SMBKRB5PWD_TRACE_RING ?
+		tr->tr_next - SMBKRB5PWD_TRACE_RING : 0;
+	for ( ; i != tr->tr_next; i++ ) {
+		ev = &tr->tr_events[ i % SMBKRB5PWD_TRACE_RING ];
+		if ( ev->ev_connid == connid &&
+		     ev->ev_opid == opid &&
+		     ev->ev_pid == pid ) {
+			events[ n++ ] = *ev;
+		}
+	}
+
+	if ( n == 0 ) {
+		return;
+	}
+
+	fd = open( cf->trace_file, O_WRONLY|O_APPEND|O_CREAT, 0600 );
+	if ( fd == -1 ) {
+		Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd : could not open trace file %s: %s\n",
+		     cf->trace_file, strerror(errno));
+		return;
+	}
+
+	/* a single O_APPEND write, so that records of slapd and of the
+	 * forked processes do not interleave */
+	if ( write( fd, events, n * sizeof( events[ 0 ] ) ) == -1 ) {
+		Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd : could not write trace file %s: %s\n",
+		     cf->trace_file, strerror(errno));
+	}
+	close( fd );
+}
+
+#define smbkrb5pwd_trace_done( pi, op, start, rc ) \
+	smbkrb5pwd_trace_done_ev( (pi), (op), (op)->o_connid, (op)->o_opid, \
+		(start), (rc) )
+
 static int
 lookup_admin_princstr(
 	char *kerberos_realm,
@@ -210,422 +782,3879 @@ error:
 	return rc;
 }
 
-static int krb5_set_passwd(
-	Operation *op,
-	req_pwdexop_s *qpw,
-	Entry *e,
-	smbkrb5pwd_t *pi)
+/* Open a kadm5 session for the admin principal of the realm. Must only
+ * be called from a kerberos helper process, see below. */
+static kadm5_ret_t
+smbkrb5pwd_kadm5_init(
+	smbkrb5pwd_realm *rm,
+	krb5_context context,
+	void **kadm5_handle)
 {
-	void *kadm5_handle;
 	kadm5_config_params params;
-	kadm5_principal_ent_rec princ;
 	kadm5_ret_t retval;
-	krb5_context context;
-	Attribute *a_objectclass, *a_uid;
-	char *user_uid = NULL, *user_password = NULL, *user_princstr = NULL;
-	int rc;
-	size_t user_princstr_size;
-	pid_t worker_pid = 0;
-	pid_t timeout_pid = 0;
-	int status = 0;
 
-	if (!access_allowed(op, e, slap_schema.si_ad_userPassword, NULL,
-			    ACL_WRITE, NULL))
-		return LDAP_INSUFFICIENT_ACCESS;
-
-	rc = LDAP_LOCAL_ERROR;
+	memset(&params, 0, sizeof(params));
+	params.mask |= KADM5_CONFIG_REALM;
+	params.realm = rm->rm_name;
+	if (rm->rm_admin_server) {
+		params.mask |= KADM5_CONFIG_ADMIN_SERVER;
+		params.admin_server = rm->rm_admin_server;
+	}
 
-	/* The krb5 kadm5 libraries seem to use global variables that hold the 
-           master key for the realm and some other realm specific data. Mutexes
-	   did not seem to get rid of all the problems related to this and 
-	   some lockups still happened, so fork the process instead before 
-	   doing any krb5 operations. The process is forked and the child sets 
-	   an alarm that kills the forked process if the password change is not 
-	   finished in 2 seconds.
-	*/
+#ifdef SMBKRB5PWD_KADM5_SRV
+	retval = kadm5_init_with_password(context, rm->rm_admin_princstr, NULL,
+					  NULL, &params,
+					  KADM5_STRUCT_VERSION,
+					  KADM5_API_VERSION_3, NULL,
+					  kadm5_handle);
+#endif
 
-	worker_pid = fork();
+#ifdef SMBKRB5PWD_KADM5_CLNT
+	retval = kadm5_init_with_skey(context, rm->rm_admin_princstr, KRB5_KEYTAB,
+				      KADM5_ADMIN_SERVICE, &params,
+				      KADM5_STRUCT_VERSION,
+				      KADM5_API_VERSION_3, NULL,
+				      kadm5_handle);
+#endif
 
-	if (worker_pid == -1) {
-		switch (errno) {
-			case EAGAIN:
-				Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-				      "smbkrb5pwd %s : failed to fork process for password change (EAGAIN)!\n",
-				      op->o_log_prefix);
+	return retval;
+}
 
-				return LDAP_LOCAL_ERROR;
-			case ENOMEM:
-				Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-				      "smbkrb5pwd %s : failed to fork process for password change (ENOMEM - No memory)!\n",
-				      op->o_log_prefix);
+/*
+ * Kerberos helpers
+ *
+ * The krb5 kadm5 libraries seem to use global variables that hold the
+ * master key for the realm and some other realm specific data. Mutexes
+ * did not seem to get rid of all the problems related to this and some
+ * lockups still happened, so all kadm5 calls are made in forked helper
+ * processes. Each helper keeps its kadm5 session open between requests.
+ *
+ * Requests and their results are passed in the slots of a memfd backed
+ * ring shared with the helpers. Slot states and the submit sequence are
+ * futex words: a slapd thread fills a slot, marks it submitted and wakes
+ * a helper; the helper serves every submitted slot it finds before it
+ * sleeps again, and wakes the waiting thread of each. A helper that does
+ * not finish a request in SMBKRB5PWD_TIMEOUT seconds is killed by its
+ * alarm and restarted by smbkrb5pwd_pool_reap().
+ *
+ * Every request is in one of the priority lanes below. Helpers always
+ * serve the most urgent lane first, and at most rg_cap[lane] of them
+ * serve a lane at the same time, so bulk jobs leave helpers free for
+ * users changing their password. The lanes also limit how many slots
+ * they may hold, so that a batch never blocks slot_get for the others.
+ */
+#define SMBKRB5PWD_HELPERS	2	/* default of olcSmbKrb5PwdHelpers */
+#define SMBKRB5PWD_SLOTS	64
+#define SMBKRB5PWD_TIMEOUT	15
+#define SMBKRB5PWD_PRINC_MAX	256
+#define SMBKRB5PWD_PW_MAX	(MAX_PWLEN*2)
+#define SMBKRB5PWD_TEXT_MAX	256
+#define SMBKRB5PWD_KEYS_MAX	4096
+
+/* sl_state, the claiming helper is kept in the upper bits: its index
+ * and the epoch of its process, so that a helper that was given up on
+ * cannot mistake a later claim of the slot for its own. The result is
+ * only written by whoever moved the slot from the claim to FINISHING. */
+#define SMBKRB5PWD_SL_FREE		0
+#define SMBKRB5PWD_SL_RESERVED		1	/* being filled by slapd */
+#define SMBKRB5PWD_SL_SUBMITTED		2
+#define SMBKRB5PWD_SL_DONE		3
+#define SMBKRB5PWD_SL_CLAIMED		4
+#define SMBKRB5PWD_SL_FINISHING		5	/* result being written */
+#define SMBKRB5PWD_SL_CLAIMED_BY(i, e)	(SMBKRB5PWD_SL_CLAIMED | \
+					 ((uint32_t)(i) & 0xffU) << 8 | \
+					 ((uint32_t)(e) & 0xffffU) << 16)
+#define SMBKRB5PWD_SL_FINISHING_BY(s)	(((s) & ~0xffU) | SMBKRB5PWD_SL_FINISHING)
+#define SMBKRB5PWD_SL_STATE(s)		((s) & 0xffU)
+#define SMBKRB5PWD_SL_HELPER(s)		((int)(((s) >> 8) & 0xffU))
+#define SMBKRB5PWD_SL_EPOCH(s)		((s) >> 16)
+#define SMBKRB5PWD_SL_HELD(s)		\
+	(SMBKRB5PWD_SL_STATE(s) == SMBKRB5PWD_SL_CLAIMED || \
+	 SMBKRB5PWD_SL_STATE(s) == SMBKRB5PWD_SL_FINISHING)
+
+/* Priority lanes, most urgent first */
+#define SMBKRB5PWD_LANE_INTERACTIVE	0	/* PasswordModify */
+#define SMBKRB5PWD_LANE_BULK		1	/* batch password modify */
+#define SMBKRB5PWD_LANE_BACKGROUND	2	/* credential upgrade */
+#define SMBKRB5PWD_LANES		3
+
+static const struct {
+	const char	*ln_name;
+	int		ln_slots;	/* reserved at most at once */
+	int		ln_wait;	/* seconds a request may wait unclaimed */
+} smbkrb5pwd_lanes[ SMBKRB5PWD_LANES ] = {
+	{ "interactive",	SMBKRB5PWD_SLOTS,	SMBKRB5PWD_TIMEOUT + 5 },
+	{ "bulk",		SMBKRB5PWD_SLOTS / 2,	SMBKRB5PWD_TIMEOUT * 4 },
+	{ "background",		SMBKRB5PWD_SLOTS / 4,	SMBKRB5PWD_TIMEOUT * 4 },
+};
 
-				return LDAP_LOCAL_ERROR;
-			case ENOSYS:
-				Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-				      "smbkrb5pwd %s : failed to fork process for password change (ENOSYS - Not supported)!\n",
-				      op->o_log_prefix);
+/* sl_req */
+#define SMBKRB5PWD_REQ_INIT	1	/* open the kadm5 session */
+#define SMBKRB5PWD_REQ_SETPW	2	/* create principal or change password */
+#define SMBKRB5PWD_REQ_KEYS	3	/* new krbPrincipalKey, LDAP KDB only */
+
+typedef struct smbkrb5pwd_slot {
+	uint32_t	sl_state;
+	uint32_t	sl_req;
+	uint32_t	sl_lane;
+	int32_t		sl_rc;		/* LDAP result code */
+	int64_t		sl_kadm5;	/* kadm5/krb5 return code */
+	uint32_t	sl_usec;	/* time the helper took */
+	uint64_t	sl_connid;
+	uint64_t	sl_opid;
+	char		sl_princ[ SMBKRB5PWD_PRINC_MAX ];
+	char		sl_password[ SMBKRB5PWD_PW_MAX ];
+	char		sl_text[ SMBKRB5PWD_TEXT_MAX ];
+	/* SMBKRB5PWD_REQ_KEYS: the highest key version of the principal
+	 * in, the encoded krbPrincipalKey value out */
+	uint32_t	sl_kvno;
+	uint32_t	sl_keys_len;
+	char		sl_keys[ SMBKRB5PWD_KEYS_MAX ];
+} smbkrb5pwd_slot;
+
+typedef struct smbkrb5pwd_ring {
+	uint32_t	rg_seq;		/* bumped on submit */
+	uint32_t	rg_shutdown;
+	uint32_t	rg_nhelpers;	/* helpers from this index on exit */
+	/* helpers allowed to serve a lane at once, set by slapd */
+	uint32_t	rg_cap[ SMBKRB5PWD_LANES ];
+	/* helpers serving a lane, and requests served */
+	uint32_t	rg_running[ SMBKRB5PWD_LANES ];
+	uint64_t	rg_done[ SMBKRB5PWD_LANES ];
+	smbkrb5pwd_slot	rg_slots[ SMBKRB5PWD_SLOTS ];
+} smbkrb5pwd_ring;
+
+/* A helper process. slapd's SIGCHLD handler reaps all children with
+ * waitpid(-1), so whether a helper is alive is asked of its pidfd,
+ * which also keeps its pid from being reused for as long as it is
+ * open; see smbkrb5pwd_helper_alive(). */
+typedef struct smbkrb5pwd_proc {
+	pid_t			pr_pid;		/* 0: none */
+	int			pr_pidfd;	/* -1: no pidfd support */
+	uint32_t		pr_epoch;	/* in its SMBKRB5PWD_SL_CLAIMED_BY */
+} smbkrb5pwd_proc;
+
+/* bumped for every helper started, see smbkrb5pwd_proc.pr_epoch */
+static uint32_t smbkrb5pwd_helper_epoch;
+
+struct smbkrb5pwd_pool {
+	smbkrb5pwd_ring		*pl_ring;
+	int			pl_nhelpers;
+	smbkrb5pwd_proc		*pl_procs;
+	/* protects pl_procs and the FREE <-> RESERVED transitions */
+	ldap_pvt_thread_mutex_t	pl_mutex;
+	ldap_pvt_thread_cond_t	pl_cond;
+	int			pl_nfree;
+	int			pl_inuse[ SMBKRB5PWD_LANES ];	/* reserved */
+	int			pl_waiting[ SMBKRB5PWD_LANES ];	/* for slots */
+};
 
-				return LDAP_LOCAL_ERROR;
-			default:
-				Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-				      "smbkrb5pwd %s : failed to fork process for password change!\n",
-				      op->o_log_prefix);
+/* state of a helper process */
+typedef struct smbkrb5pwd_helper {
+	smbkrb5pwd_t	*hl_pi;
+	smbkrb5pwd_realm *hl_realm;
+	smbkrb5pwd_ring	*hl_ring;
+	uint32_t	hl_claim;	/* SMBKRB5PWD_SL_CLAIMED_BY() */
+	krb5_context	hl_context;
+	void		*hl_kadm5;
+#ifdef SMBKRB5PWD_KADM5_SRV
+	/* for SMBKRB5PWD_REQ_KEYS, read once per kadm5 session */
+	int			hl_have_params;
+	kadm5_config_params	hl_params;
+	krb5_actkvno_node	*hl_actkvno;
+	/* the derived keys, until they are copied to the slot */
+	uint32_t		hl_keys_len;
+	char			hl_keys[ SMBKRB5PWD_KEYS_MAX ];
+#endif
+} smbkrb5pwd_helper;
 
-				return LDAP_LOCAL_ERROR;
-		}
-	}
+static void
+smbkrb5pwd_wipe( void *p, size_t len )
+{
+	volatile char *c = p;
 
-	if (worker_pid) {
-		waitpid(worker_pid, &status, 0);
+	while ( len-- )
+		*c++ = '\0';
+}
 
-		if (status == SIGALRM) {
-			Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-			      "smbkrb5pwd %s : forked password change process did not complete in 15s\n",
-			      op->o_log_prefix);
+static int
+smbkrb5pwd_futex_wait( uint32_t *addr, uint32_t val,
+	const struct timespec *timeout )
+{
+	/* not FUTEX_PRIVATE_FLAG, the ring is shared between processes */
+	return syscall( SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0 );
+}
 
-			return LDAP_LOCAL_ERROR;
-		}
+static void
+smbkrb5pwd_futex_wake( uint32_t *addr, int n )
+{
+	syscall( SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0 );
+}
 
-		return status;
+/* Password quality errors; these are final and reported to the client
+ * as a constraint violation */
+static int
+smbkrb5pwd_kadm5_quality( kadm5_ret_t retval )
+{
+	switch ( retval ) {
+	case KADM5_PASS_Q_TOOSHORT:
+	case KADM5_PASS_Q_CLASS:
+	case KADM5_PASS_Q_DICT:
+#ifdef KADM5_PASS_Q_GENERIC
+	case KADM5_PASS_Q_GENERIC:
+#endif
+	case KADM5_PASS_REUSE:
+	case KADM5_PASS_TOOSOON:
+		return 1;
 	}
+	return 0;
+}
 
-	signal(SIGALRM, SIG_DFL);
-	alarm(15);
-
-	kadm5_handle = NULL;
-	memset(&princ, 0, sizeof(princ));
-	memset(&params, 0, sizeof(params));
-	princ.principal = NULL;
+static kadm5_ret_t
+smbkrb5pwd_helper_open(
+	smbkrb5pwd_helper *h,
+	smbkrb5pwd_slot *slot,
+	const char **what )
+{
+	smbkrb5pwd_t *pi = h->hl_pi;
+	kadm5_ret_t retval;
+	struct timespec ts;
 
-	/* Find the uid of the user - this is used to generate the kerberos
-	 * principal for the user */
+	if (h->hl_kadm5)
+		return KADM5_OK;
 
-	/* XXX add user information to all error messages */
+	SMBKRB5PWD_PROBE_BEGIN(SMBKRB5PWD_PH_KADM5_INIT, slot->sl_connid,
+			       slot->sl_opid, h->hl_realm->rm_admin_princstr);
+	smbkrb5pwd_trace_begin(&ts);
 
-	a_uid = attr_find(e->e_attrs, ad_uid);
-	if (!a_uid) {
-		Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-		      "smbkrb5pwd %s : could not find uid in entry: %s\n",
-		      op->o_log_prefix,
-		      ldap_err2string(LDAP_NO_SUCH_ATTRIBUTE));
-		rc = LDAP_NO_SUCH_ATTRIBUTE;
-		goto finish;
+#ifdef SMBKRB5PWD_KADM5_CLNT
+	{
+		krb5_keytab keytab;
+		krb5_keytab_entry kt_entry;
+		krb5_principal admin_princ;
+
+		*what = "keytab " KRB5_KEYTAB;
+		retval = krb5_kt_resolve(h->hl_context, KRB5_KEYTAB, &keytab);
+		if (!retval) {
+			retval = krb5_parse_name(h->hl_context,
+						 h->hl_realm->rm_admin_princstr,
+						 &admin_princ);
+			if (!retval) {
+				retval = krb5_kt_get_entry(h->hl_context,
+							   keytab, admin_princ,
+							   0, 0, &kt_entry);
+				if (!retval)
+					krb5_kt_free_entry(h->hl_context,
+							   &kt_entry);
+				krb5_free_principal(h->hl_context,
+						    admin_princ);
+			}
+			krb5_kt_close(h->hl_context, keytab);
+		}
 	}
+#else
+	retval = KADM5_OK;
+#endif
 
-	user_uid = calloc(a_uid->a_vals[0].bv_len + 1, 1);
-        user_password = calloc(qpw->rs_new.bv_len + 1, 1);
-
-        memcpy(user_uid, a_uid->a_vals[0].bv_val, a_uid->a_vals[0].bv_len);
-        memcpy(user_password, qpw->rs_new.bv_val, qpw->rs_new.bv_len);
-
-	retval = kadm5_init_krb5_context(&context);
-	if (retval) {
-		Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-		     "smbkrb5pwd %s : kadm5_init_krb5_context() failed"
-		     " for user %s: %s\n",
-		     op->o_log_prefix, user_uid, error_message(retval));
-		rc = LDAP_CONNECT_ERROR;
-		goto finish;
+	if (retval == KADM5_OK) {
+		*what = "kadm5 init";
+		retval = smbkrb5pwd_kadm5_init(h->hl_realm, h->hl_context,
+					       &h->hl_kadm5);
+		if (retval)
+			h->hl_kadm5 = NULL;
 	}
 
-	params.mask |= KADM5_CONFIG_REALM;
-	params.realm = pi->kerberos_realm;
+	smbkrb5pwd_trace_ev(pi, NULL, slot->sl_connid, slot->sl_opid,
+			    SMBKRB5PWD_PH_KADM5_INIT, &ts, retval,
+			    LDAP_SUCCESS);
+	return retval;
+}
 
+static void
+smbkrb5pwd_helper_close( smbkrb5pwd_helper *h )
+{
 #ifdef SMBKRB5PWD_KADM5_SRV
-	retval = kadm5_init_with_password(context, pi->admin_princstr, NULL,
-					  NULL, &params,
-					  KADM5_STRUCT_VERSION,
-					  KADM5_API_VERSION_3, NULL,
-					  &kadm5_handle);
-#endif
-
-#ifdef SMBKRB5PWD_KADM5_CLNT
-        retval = kadm5_init_with_skey(context, pi->admin_princstr, KRB5_KEYTAB,
-                                 KADM5_ADMIN_SERVICE, &params,
-                                 KADM5_STRUCT_VERSION,
-                                 KADM5_API_VERSION_3, NULL,
-                                 &kadm5_handle);
-#endif
-
-	if (retval) {
-		Log4(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-		      "smbkrb5pwd %s : kadm5_init_with_password() failed"
-		      " for user %s (%s): %s\n",
-  		      op->o_log_prefix, user_uid, pi->admin_princstr, error_message(retval));
-		rc = LDAP_CONNECT_ERROR;
-		goto mitkrb_error_with_context;
+	if (h->hl_actkvno) {
+		krb5_dbe_free_actkvno_list(h->hl_context, h->hl_actkvno);
+		h->hl_actkvno = NULL;
 	}
-
-	user_princstr_size = strlen(user_uid)
-			     + sizeof("@")
-			     + strlen(pi->kerberos_realm)
-	                     + 1;
-	if ((user_princstr = calloc(user_princstr_size, 1)) == NULL) {
-		rc = LDAP_CONNECT_ERROR;
-		goto mitkrb_error_with_kadm5_handle;
+	if (h->hl_have_params) {
+		kadm5_free_config_params(h->hl_context, &h->hl_params);
+		h->hl_have_params = 0;
 	}
-	snprintf(user_princstr, user_princstr_size, "%s@%s", user_uid,
-		 pi->kerberos_realm);
-
-	retval = krb5_parse_name(context, user_princstr, &princ.principal);
-	if (retval) {
-		Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-		     "smbkrb5pwd %s : krb5_parse_name() failed"
-		     " for user %s: %s\n",
-		     op->o_log_prefix, user_princstr, error_message(retval));
-		rc = LDAP_CONNECT_ERROR;
-		goto mitkrb_error_with_user_princstr;
+#endif
+	if (h->hl_kadm5) {
+		kadm5_destroy(h->hl_kadm5);
+		h->hl_kadm5 = NULL;
 	}
+}
 
+/* Create the principal, or change its password if it exists */
+static kadm5_ret_t
+smbkrb5pwd_helper_setpw(
+	smbkrb5pwd_helper *h,
+	smbkrb5pwd_slot *slot,
+	const char **what )
+{
+	smbkrb5pwd_t *pi = h->hl_pi;
+	kadm5_principal_ent_rec princ;
+	kadm5_ret_t retval;
+	struct timespec ts;
 	long create_mask = KADM5_PRINCIPAL|KADM5_MAX_LIFE|KADM5_ATTRIBUTES;
+
+	memset(&princ, 0, sizeof(princ));
+
+	*what = "krb5_parse_name";
+	retval = krb5_parse_name(h->hl_context, slot->sl_princ,
+				 &princ.principal);
+	if (retval)
+		return retval;
+
+	*what = "kadm5_create_principal";
 	princ.attributes |= KRB5_KDB_REQUIRES_PRE_AUTH;
-	retval = kadm5_create_principal(kadm5_handle, &princ, create_mask,
-					user_password);
+	SMBKRB5PWD_PROBE_BEGIN(SMBKRB5PWD_PH_KADM5_CREATE, slot->sl_connid,
+			       slot->sl_opid, slot->sl_princ);
+	smbkrb5pwd_trace_begin(&ts);
+	retval = kadm5_create_principal(h->hl_kadm5, &princ, create_mask,
+					slot->sl_password);
+	smbkrb5pwd_trace_ev(pi, NULL, slot->sl_connid, slot->sl_opid,
+			    SMBKRB5PWD_PH_KADM5_CREATE, &ts,
+			    retval == KADM5_DUP ? 0 : retval, LDAP_SUCCESS);
 	if (retval == KADM5_OK) {
-		Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
-		     "smbkrb5pwd %s : created principal for user %s\n",
-		     op->o_log_prefix, user_princstr);
-		rc = LDAP_SUCCESS;
+		Log3(LDAP_DEBUG_TRACE, LDAP_LEVEL_NOTICE,
+		     "smbkrb5pwd conn=%lu op=%lu : created principal %s\n",
+		     (unsigned long)slot->sl_connid,
+		     (unsigned long)slot->sl_opid, slot->sl_princ);
 	} else if (retval == KADM5_DUP) {
 		/* principal exists, only change password */
-		retval = kadm5_chpass_principal(kadm5_handle, princ.principal,
-						user_password);
-		if (retval) {
-			Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-			     "smbkrb5pwd %s : kadm5_chpass_principal() failed "
-			     "for user %s: %s\n",
-			     op->o_log_prefix, user_princstr,
-			     error_message(retval));
-			rc = LDAP_CONNECT_ERROR;
-			goto mitkrb_error_with_princ;
-		} else {
-			Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
-			     "smbkrb5pwd %s : changed password for user %s\n",
-			     op->o_log_prefix, user_princstr);
-			rc = LDAP_SUCCESS;
+		*what = "kadm5_chpass_principal";
+		SMBKRB5PWD_PROBE_BEGIN(SMBKRB5PWD_PH_KADM5_CHPASS,
+				       slot->sl_connid, slot->sl_opid,
+				       slot->sl_princ);
+		smbkrb5pwd_trace_begin(&ts);
+		retval = kadm5_chpass_principal(h->hl_kadm5, princ.principal,
+						slot->sl_password);
+		smbkrb5pwd_trace_ev(pi, NULL, slot->sl_connid, slot->sl_opid,
+				    SMBKRB5PWD_PH_KADM5_CHPASS, &ts,
+				    retval, LDAP_SUCCESS);
+		if (retval == KADM5_OK) {
+			Log3(LDAP_DEBUG_TRACE, LDAP_LEVEL_NOTICE,
+			     "smbkrb5pwd conn=%lu op=%lu : changed password"
+			     " of %s\n",
+			     (unsigned long)slot->sl_connid,
+			     (unsigned long)slot->sl_opid, slot->sl_princ);
 		}
-	} else {
-		Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-		     "smbkrb5pwd %s : Problem creating principal for user %s: "
-		     "%s\n", op->o_log_prefix, user_princstr,
-		     error_message(retval));
-		rc = LDAP_CONNECT_ERROR;
-		goto mitkrb_error_with_princ;
-	}
-
-mitkrb_error_with_princ:
-	krb5_free_principal(context, princ.principal);
-mitkrb_error_with_kadm5_handle:
-	kadm5_destroy(kadm5_handle);
-mitkrb_error_with_user_princstr:
-	free(user_princstr);
-mitkrb_error_with_context:
-	krb5_free_context(context);
-finish:
-	if (user_uid)
-	  free(user_uid);
+	}
 
-	if (user_password)
-	  free(user_password);
+	krb5_free_principal(h->hl_context, princ.principal);
 
-	_exit(rc);
+	return retval;
 }
 
-static int smbkrb5pwd_exop_passwd(
-	Operation *op,
-	SlapReply *rs)
+#ifdef SMBKRB5PWD_KADM5_SRV
+/* Derive new keys of the principal from the password and encrypt them
+ * with the active master key, like kadm5_chpass_principal() does, but
+ * return them as a krbPrincipalKey value instead of storing them. The
+ * kadm5 server handle works on hl_context, which therefore has the KDB
+ * open and the master keys loaded. */
+static kadm5_ret_t
+smbkrb5pwd_helper_keys(
+	smbkrb5pwd_helper *h,
+	smbkrb5pwd_slot *slot,
+	const char **what )
 {
-	int rc, rc_krb5;
-	req_pwdexop_s *qpw = &op->oq_pwdexop;
-	Entry *e;
-	Modifications *ml;
-	slap_overinst *on = (slap_overinst *)op->o_bd->bd_info;
-	smbkrb5pwd_t *pi = on->on_bi.bi_private;
-	char term;
+	kadm5_config_params params;
+	krb5_db_entry ent;
+	krb5_principal mprinc;
+	krb5_keyblock *mkey;
+	krb5_kvno mkvno;
+	smbkrb5pwd_seqof_key_data seq;
+	krb5_data *code = NULL;
+	kadm5_ret_t retval;
+	int i;
 
-	/* Not the operation we expected, pass it on... */
-	if ( ber_bvcmp( &slap_EXOP_MODIFY_PASSWD, &op->ore_reqoid ) ) {
-		return SLAP_CB_CONTINUE;
+	if (!h->hl_have_params) {
+		*what = "kadm5_get_config_params";
+		memset(&params, 0, sizeof(params));
+		params.mask |= KADM5_CONFIG_REALM;
+		params.realm = h->hl_realm->rm_name;
+		retval = kadm5_get_config_params(h->hl_context, 1, &params,
+						 &h->hl_params);
+		if (retval)
+			return retval;
+		h->hl_have_params = 1;
 	}
 
-	op->o_bd->bd_info = (BackendInfo *)on->on_info;
-	rc = be_entry_get_rw( op, &op->o_req_ndn, NULL, NULL, 0, &e );
-	if ( rc != LDAP_SUCCESS ) return rc;
-
-	term = qpw->rs_new.bv_val[qpw->rs_new.bv_len];
-	qpw->rs_new.bv_val[qpw->rs_new.bv_len] = '\0';
+	if (h->hl_actkvno == NULL) {
+		*what = "krb5_dbe_fetch_act_key_list";
+		retval = krb5_db_setup_mkey_name(h->hl_context,
+						 h->hl_params.mkey_name,
+						 h->hl_realm->rm_name,
+						 NULL, &mprinc);
+		if (retval)
+			return retval;
+		retval = krb5_dbe_fetch_act_key_list(h->hl_context, mprinc,
+						     &h->hl_actkvno);
+		krb5_free_principal(h->hl_context, mprinc);
+		if (retval)
+			return retval;
+	}
 
-	rc = SLAP_CB_CONTINUE;
-	if (pi->oc_requiredObjectclass &&
-	    !is_entry_objectclass(e, pi->oc_requiredObjectclass, 0)) {
-		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
-	     	     "smbkrb5pwd %s : an entry is not of required"
-		     " objectClass\n",
-	     	     op->o_log_prefix);
-		rc = LDAP_PARAM_ERROR;
-		goto finish;
+	*what = "krb5_dbe_find_act_mkey";
+	retval = krb5_dbe_find_act_mkey(h->hl_context, h->hl_actkvno,
+					&mkvno, &mkey);
+	if (retval)
+		return retval;
+
+	memset(&ent, 0, sizeof(ent));
+	*what = "krb5_parse_name";
+	retval = krb5_parse_name(h->hl_context, slot->sl_princ, &ent.princ);
+	if (retval)
+		return retval;
+
+	/* no old keys are kept, so the new version only comes from sl_kvno */
+	*what = "krb5_dbe_cpw";
+	retval = krb5_dbe_cpw(h->hl_context, mkey, h->hl_params.keysalts,
+			      h->hl_params.num_keysalts, slot->sl_password,
+			      slot->sl_kvno + 1, FALSE, &ent);
+	if (retval)
+		goto done;
+
+	*what = "krb5int_ldap_encode_sequence_of_keys";
+	memset(&seq, 0, sizeof(seq));
+	seq.mkvno = mkvno;
+	seq.kvno = ent.n_key_data ? ent.key_data[0].key_data_kvno : 0;
+	seq.key_data = ent.key_data;
+	seq.n_key_data = ent.n_key_data;
+	retval = krb5int_ldap_encode_sequence_of_keys(&seq, &code);
+	if (retval)
+		goto done;
+
+	if (code->length > sizeof(h->hl_keys)) {
+		retval = ERANGE;
+		goto done;
 	}
+	memcpy(h->hl_keys, code->data, code->length);
+	h->hl_keys_len = code->length;
+
+	Log3(LDAP_DEBUG_TRACE, LDAP_LEVEL_NOTICE,
+	     "smbkrb5pwd conn=%lu op=%lu : derived keys of %s\n",
+	     (unsigned long)slot->sl_connid,
+	     (unsigned long)slot->sl_opid, slot->sl_princ);
+
+done:
+	if (code)
+		krb5_free_data(h->hl_context, code);
+	for (i = 0; i < ent.n_key_data; i++)
+		krb5_dbe_free_key_data_contents(h->hl_context,
+						&ent.key_data[i]);
+	free(ent.key_data);
+	krb5_free_principal(h->hl_context, ent.princ);
+
+	return retval;
+}
+#endif
 
-	if (SMBKRB5PWD_DO_KRB5(pi)) {
-		Attribute *a;
-		struct berval *keys;
+#ifdef SMBKRB5PWD_FAULT
+/*
+ * Fault injection, for soak runs of slapd without a kadmind (see
+ * smbkrb5pwd-soak.sh). Only built with -DSMBKRB5PWD_FAULT. The helpers
+ * read the environment variable SMBKRB5PWD_FAULT of slapd when they
+ * start, e.g. "stub delay=20 error=1 hang=0.1 crash=0.1":
+ *
+ *	stub		answer requests without kadm5, successfully
+ *	delay=ms	time a stubbed request takes
+ *	error=pct	fail that percentage of requests with KADM5_RPC_ERROR
+ *	hang=pct	hang until the alarm of the helper kills it
+ *	crash=pct	kill the helper with SIGKILL
+ *
+ * Opening the kadm5 session is never failed on purpose. The
+ * SMBKRB5PWD_REQ_KEYS requests cannot be stubbed and fail with ENOTSUP.
+ */
+static struct {
+	int	ft_stub;
+	int	ft_delay;
+	double	ft_error;
+	double	ft_hang;
+	double	ft_crash;
+} smbkrb5pwd_fault;
+
+static void
+smbkrb5pwd_fault_init( void )
+{
+	char *env, *buf, *tok, *next;
+
+	memset(&smbkrb5pwd_fault, 0, sizeof(smbkrb5pwd_fault));
+	if ((env = getenv("SMBKRB5PWD_FAULT")) == NULL)
+		return;
+
+	srand48(getpid() ^ time(NULL));
+
+	buf = ch_strdup(env);
+	for (tok = strtok_r(buf, " ,", &next); tok;
+	     tok = strtok_r(NULL, " ,", &next)) {
+		if (!strcmp(tok, "stub"))
+			smbkrb5pwd_fault.ft_stub = 1;
+		else if (!strncmp(tok, "delay=", STRLENOF("delay=")))
+			smbkrb5pwd_fault.ft_delay = atoi(tok + STRLENOF("delay="));
+		else if (!strncmp(tok, "error=", STRLENOF("error=")))
+			smbkrb5pwd_fault.ft_error = atof(tok + STRLENOF("error="));
+		else if (!strncmp(tok, "hang=", STRLENOF("hang=")))
+			smbkrb5pwd_fault.ft_hang = atof(tok + STRLENOF("hang="));
+		else if (!strncmp(tok, "crash=", STRLENOF("crash=")))
+			smbkrb5pwd_fault.ft_crash = atof(tok + STRLENOF("crash="));
+		else
+			Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+			     "smbkrb5pwd : unknown fault \"%s\" ignored\n", tok);
+	}
+	ch_free(buf);
+}
 
-		/* if this fails, do not bother with samba,
-		   because passwords should be kept in sync */
-		rc_krb5 = krb5_set_passwd(op, qpw, e, pi);
-		if (rc_krb5 != LDAP_SUCCESS) {
-			rc = rc_krb5;
-			goto finish;
+/* Returns 1 if the request was answered here, with *retval */
+static int
+smbkrb5pwd_fault_inject(
+	smbkrb5pwd_slot *slot,
+	const char **what,
+	kadm5_ret_t *retval )
+{
+	double r = drand48() * 100;
+
+	*what = "fault injection";
+
+	/* the realm must become ready to be tested at all */
+	if (slot->sl_req != SMBKRB5PWD_REQ_INIT) {
+		if ((r -= smbkrb5pwd_fault.ft_crash) < 0)
+			kill(getpid(), SIGKILL);
+		if ((r -= smbkrb5pwd_fault.ft_hang) < 0)
+			for (;;)
+				pause();
+		if ((r -= smbkrb5pwd_fault.ft_error) < 0) {
+			*retval = KADM5_RPC_ERROR;
+			return 1;
 		}
+	}
 
-		if (pi->keep_sasl_id == 1) {
-			a = attr_find( e->e_attrs, ad_userPassword );
-			if (a) {
-				const char* SASL_SCHEME = "{sasl}";
-				const int SASL_SCHEME_LEN = 6;
-				if (a->a_vals[0].bv_len >= SASL_SCHEME_LEN && strncasecmp(a->a_vals[0].bv_val, SASL_SCHEME, SASL_SCHEME_LEN) == 0) {
-
-					ml = ch_malloc(sizeof(Modifications));
-					if (!qpw->rs_modtail) qpw->rs_modtail = &ml->sml_next;
-					ml->sml_next = qpw->rs_mods;
-					qpw->rs_mods = ml;
+	if (!smbkrb5pwd_fault.ft_stub)
+		return 0;
 
-					keys = ch_malloc( 2 * sizeof(struct berval) );
-					BER_BVZERO( &keys[1] );
-					ber_dupbv(keys, &a->a_vals[0]);
+	if (smbkrb5pwd_fault.ft_delay > 0)
+		usleep(smbkrb5pwd_fault.ft_delay * 1000);
+	*retval = slot->sl_req == SMBKRB5PWD_REQ_KEYS ? ENOTSUP : KADM5_OK;
+	return 1;
+}
+#endif
 
-					ml->sml_desc = ad_userPassword;
-					ml->sml_op = LDAP_MOD_REPLACE;
-#ifdef SLAP_MOD_INTERNAL
-					ml->sml_flags = SLAP_MOD_INTERNAL;
+static void
+smbkrb5pwd_helper_serve( smbkrb5pwd_helper *h, smbkrb5pwd_slot *slot )
+{
+	smbkrb5pwd_t *pi = h->hl_pi;
+	const char *what = "";
+	kadm5_ret_t retval = KADM5_OK;
+	struct timespec ts;
+	char text[ SMBKRB5PWD_TEXT_MAX ] = "";
+	uint32_t lane = slot->sl_lane, state, usec;
+	int attempt, rc;
+
+	smbkrb5pwd_trace_begin(&ts);
+#ifdef SMBKRB5PWD_KADM5_SRV
+	h->hl_keys_len = 0;
 #endif
-					ml->sml_numvals = 1;
-					ml->sml_values = keys;
-					ml->sml_nvalues = NULL;
+
+	/* the default action of SIGALRM terminates a hung helper */
+	alarm(SMBKRB5PWD_TIMEOUT);
+
+	for (attempt = 0; attempt < 2; attempt++) {
+#ifdef SMBKRB5PWD_FAULT
+		if (smbkrb5pwd_fault_inject(slot, &what, &retval))
+			break;
+#endif
+		retval = smbkrb5pwd_helper_open(h, slot, &what);
+		if (retval == KADM5_OK && slot->sl_req == SMBKRB5PWD_REQ_SETPW)
+			retval = smbkrb5pwd_helper_setpw(h, slot, &what);
+#ifdef SMBKRB5PWD_KADM5_SRV
+		if (retval == KADM5_OK && slot->sl_req == SMBKRB5PWD_REQ_KEYS)
+			retval = smbkrb5pwd_helper_keys(h, slot, &what);
+#endif
+		if (retval == KADM5_OK || smbkrb5pwd_kadm5_quality(retval))
+			break;
+		/* the session may have gone stale (expired ticket,
+		 * restarted kadmind), retry once with a new one */
+		smbkrb5pwd_helper_close(h);
+	}
+
+	alarm(0);
+
+	if (retval == KADM5_OK) {
+		rc = LDAP_SUCCESS;
+	} else {
+		rc = smbkrb5pwd_kadm5_quality(retval) ?
+			LDAP_CONSTRAINT_VIOLATION : LDAP_OTHER;
+		snprintf(text, sizeof(text), "%s failed: %s (%ld)", what,
+			 error_message(retval), (long)retval);
+		Log4(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd conn=%lu op=%lu : %s: %s\n",
+		     (unsigned long)slot->sl_connid,
+		     (unsigned long)slot->sl_opid,
+		     slot->sl_req != SMBKRB5PWD_REQ_INIT ?
+		     slot->sl_princ : h->hl_realm->rm_admin_princstr,
+		     text);
+	}
+
+	usec = smbkrb5pwd_trace_elapsed(&ts);
+	smbkrb5pwd_trace_done_ev(pi, NULL, slot->sl_connid, slot->sl_opid,
+				 &ts, rc);
+
+	/* slapd may have given up on the request, failed it and even
+	 * reused the slot meanwhile; then the result is not ours to
+	 * write, and smbkrb5pwd_slot_fail() gave the lane back */
+	state = h->hl_claim;
+	if (!__atomic_compare_exchange_n(&slot->sl_state, &state,
+			SMBKRB5PWD_SL_FINISHING_BY(h->hl_claim), 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd : kerberos helper finished a request"
+		     " that was failed already (%d, %ld)\n",
+		     rc, (long)retval);
+#ifdef SMBKRB5PWD_KADM5_SRV
+		smbkrb5pwd_wipe(h->hl_keys, h->hl_keys_len);
+#endif
+		return;
+	}
+
+	smbkrb5pwd_wipe(slot->sl_password, sizeof(slot->sl_password));
+	slot->sl_kadm5 = retval;
+	slot->sl_rc = rc;
+	slot->sl_usec = usec;
+	memcpy(slot->sl_text, text, sizeof(slot->sl_text));
+#ifdef SMBKRB5PWD_KADM5_SRV
+	memcpy(slot->sl_keys, h->hl_keys, h->hl_keys_len);
+	slot->sl_keys_len = h->hl_keys_len;
+	smbkrb5pwd_wipe(h->hl_keys, h->hl_keys_len);
+#endif
+
+	/* before DONE, smbkrb5pwd_pool_reap() releases it for CLAIMED */
+	__atomic_sub_fetch(&h->hl_ring->rg_running[lane], 1,
+			   __ATOMIC_RELEASE);
+	__atomic_add_fetch(&h->hl_ring->rg_done[lane], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->sl_state, SMBKRB5PWD_SL_DONE,
+			 __ATOMIC_RELEASE);
+	smbkrb5pwd_futex_wake(&slot->sl_state, INT_MAX);
+}
+
+/* A helper must not keep slapd's listeners and database files open */
+static void
+smbkrb5pwd_close_fds( void )
+{
+	DIR *dir;
+	struct dirent *d;
+	int fd;
+
+	if ((dir = opendir("/proc/self/fd")) == NULL)
+		return;
+
+	while ((d = readdir(dir)) != NULL) {
+		fd = atoi(d->d_name);
+		if (fd > 2 && fd != dirfd(dir))
+			close(fd);
+	}
+
+	closedir(dir);
+}
+
+/* Claim the next submitted slot of the most urgent lane that has not
+ * reached its cap of helpers */
+static smbkrb5pwd_slot *
+smbkrb5pwd_helper_claim( smbkrb5pwd_ring *ring, uint32_t claim )
+{
+	smbkrb5pwd_slot *slot;
+	uint32_t cap, running, state;
+	int lane, i;
+
+	for (lane = 0; lane < SMBKRB5PWD_LANES; lane++) {
+		/* take a place in the lane before looking for its slots */
+		cap = __atomic_load_n(&ring->rg_cap[lane], __ATOMIC_ACQUIRE);
+		running = __atomic_load_n(&ring->rg_running[lane],
+					  __ATOMIC_RELAXED);
+		do {
+			if (running >= cap)
+				break;
+		} while (!__atomic_compare_exchange_n(&ring->rg_running[lane],
+				&running, running + 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+		if (running >= cap)
+			continue;
+
+		for (i = 0; i < SMBKRB5PWD_SLOTS; i++) {
+			slot = &ring->rg_slots[i];
+			state = SMBKRB5PWD_SL_SUBMITTED;
+			if (__atomic_load_n(&slot->sl_state,
+					    __ATOMIC_ACQUIRE) != state ||
+			    slot->sl_lane != (uint32_t)lane ||
+			    !__atomic_compare_exchange_n(&slot->sl_state,
+					&state, claim,
+					0, __ATOMIC_ACQ_REL,
+					__ATOMIC_RELAXED))
+				continue;
+			return slot;
+		}
+
+		__atomic_sub_fetch(&ring->rg_running[lane], 1,
+				   __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/* Helpers exit when slapd does. PR_SET_PDEATHSIG cannot be used for
+ * that: it fires when the thread that forked the helper exits, and
+ * helpers are forked from pool threads that come and go with
+ * olcThreads. Instead an idle helper checks every second that it was
+ * not orphaned; a busy one is bounded by its alarm. */
+#define SMBKRB5PWD_HELPER_PARENT_CHECK	1
+
+static void
+smbkrb5pwd_helper_main( smbkrb5pwd_realm *rm, int idx, uint32_t epoch,
+	pid_t parent )
+{
+	smbkrb5pwd_t *pi = rm->rm_pi;
+	smbkrb5pwd_ring *ring = rm->rm_pool->pl_ring;
+	smbkrb5pwd_slot *slot;
+	smbkrb5pwd_helper h;
+	kadm5_ret_t retval;
+	sigset_t set;
+	uint32_t seq;
+	struct timespec tick = { SMBKRB5PWD_HELPER_PARENT_CHECK, 0 };
+
+	smbkrb5pwd_close_fds();
+
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGALRM, SIG_DFL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (smbkrb5pwd_conf_get(pi)->trace_file)
+		smbkrb5pwd_helper_ring = ch_calloc(1,
+			sizeof(smbkrb5pwd_trace_ring));
+
+	memset(&h, 0, sizeof(h));
+	h.hl_pi = pi;
+	h.hl_realm = rm;
+	h.hl_ring = ring;
+	h.hl_claim = SMBKRB5PWD_SL_CLAIMED_BY(idx, epoch);
+
+#ifdef SMBKRB5PWD_FAULT
+	smbkrb5pwd_fault_init();
+#endif
+
+	retval = kadm5_init_krb5_context(&h.hl_context);
+	if (retval) {
+		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd : kadm5_init_krb5_context() failed: %s\n",
+		     error_message(retval));
+		_exit(1);
+	}
+
+	for (;;) {
+		seq = __atomic_load_n(&ring->rg_seq, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ring->rg_shutdown, __ATOMIC_ACQUIRE) ||
+		    (uint32_t)idx >= __atomic_load_n(&ring->rg_nhelpers,
+						     __ATOMIC_ACQUIRE) ||
+		    getppid() != parent)
+			break;
+
+		/* serve everything that is pending before sleeping,
+		 * looking for the most urgent request after each */
+		if ((slot = smbkrb5pwd_helper_claim(ring, h.hl_claim)) != NULL)
+			smbkrb5pwd_helper_serve(&h, slot);
+		else
+			smbkrb5pwd_futex_wait(&ring->rg_seq, seq, &tick);
+	}
+
+	smbkrb5pwd_helper_close(&h);
+	krb5_free_context(h.hl_context);
+	_exit(0);
+}
+
+static void
+smbkrb5pwd_helper_start( smbkrb5pwd_realm *rm, int idx, smbkrb5pwd_proc *pr )
+{
+	pid_t pid, parent = getpid();
+
+	pr->pr_pid = 0;
+	pr->pr_pidfd = -1;
+	pr->pr_epoch = __atomic_add_fetch(&smbkrb5pwd_helper_epoch, 1,
+					  __ATOMIC_RELAXED) & 0xffffU;
+
+	pid = fork();
+	if (pid == -1) {
+		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd : failed to fork kerberos helper: %s\n",
+		     strerror(errno));
+		return;
+	}
+
+	if (pid == 0)
+		smbkrb5pwd_helper_main(rm, idx, pr->pr_epoch, parent);
+
+	pr->pr_pid = pid;
+#ifdef SYS_pidfd_open
+	/* ESRCH if it is already gone; then waitpid() below tells */
+	pr->pr_pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+}
+
+/* Is the helper still running? Without a pidfd (Linux before 5.3) only
+ * waitpid() can tell, which fails with ECHILD once slapd's SIGCHLD
+ * handler has reaped the helper; that counts as dead too. */
+static int
+smbkrb5pwd_helper_alive( smbkrb5pwd_proc *pr )
+{
+	struct pollfd pfd;
+	int status;
+	pid_t rc;
+
+	if ( pr->pr_pid <= 0 ) {
+		return 0;
+	}
+
+	if ( pr->pr_pidfd >= 0 ) {
+		pfd.fd = pr->pr_pidfd;
+		pfd.events = POLLIN;
+		return poll( &pfd, 1, 0 ) == 0;
+	}
+
+	rc = waitpid( pr->pr_pid, &status, WNOHANG );
+	return rc == 0 || ( rc == -1 && errno != ECHILD );
+}
+
+/* Signal a helper, but only one known to be our child: through its
+ * pidfd, or while waitpid() shows it is not reaped yet and its pid
+ * cannot have been reused */
+static void
+smbkrb5pwd_helper_signal( smbkrb5pwd_proc *pr, int sig )
+{
+	if ( pr->pr_pid <= 0 ) {
+		return;
+	}
+#ifdef SYS_pidfd_send_signal
+	if ( pr->pr_pidfd >= 0 ) {
+		syscall( SYS_pidfd_send_signal, pr->pr_pidfd, sig, NULL, 0 );
+		return;
+	}
+#endif
+	if ( smbkrb5pwd_helper_alive( pr ) ) {
+		kill( pr->pr_pid, sig );
+	}
+}
+
+/* Reap a helper that exited, unless slapd already did, and forget it */
+static void
+smbkrb5pwd_helper_forget( smbkrb5pwd_proc *pr )
+{
+	int status;
+
+	if ( pr->pr_pid > 0 ) {
+		waitpid( pr->pr_pid, &status, WNOHANG );
+	}
+	if ( pr->pr_pidfd >= 0 ) {
+		close( pr->pr_pidfd );
+	}
+	pr->pr_pid = 0;
+	pr->pr_pidfd = -1;
+}
+
+/* Wait for a helper that was told to exit, killing it if it does not
+ * within two seconds */
+static void
+smbkrb5pwd_helper_stop( smbkrb5pwd_proc *pr )
+{
+	int t;
+
+	for ( t = 0; t < 20 && smbkrb5pwd_helper_alive( pr ); t++ ) {
+		usleep( 100000 );
+	}
+	if ( smbkrb5pwd_helper_alive( pr ) ) {
+		smbkrb5pwd_helper_signal( pr, SIGKILL );
+		for ( t = 0; t < 20 && smbkrb5pwd_helper_alive( pr ); t++ ) {
+			usleep( 100000 );
+		}
+	}
+	smbkrb5pwd_helper_forget( pr );
+}
+
+/* Give back the place in the lane of a request whose helper died */
+static void
+smbkrb5pwd_lane_release( smbkrb5pwd_ring *ring, int lane )
+{
+	uint32_t running;
+
+	running = __atomic_load_n( &ring->rg_running[ lane ], __ATOMIC_RELAXED );
+	while ( running > 0 &&
+		!__atomic_compare_exchange_n( &ring->rg_running[ lane ],
+				&running, running - 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) )
+		;
+}
+
+/* Fail a request that its helper holds with state, unless the helper
+ * finished it meanwhile; the slot is taken over before the result is
+ * written, so that a result of the helper is never overwritten */
+static void
+smbkrb5pwd_slot_fail( smbkrb5pwd_pool *pool, smbkrb5pwd_slot *slot,
+	uint32_t state, const char *text )
+{
+	if ( !__atomic_compare_exchange_n( &slot->sl_state, &state,
+			SMBKRB5PWD_SL_FINISHING, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) ) {
+		return;
+	}
+	smbkrb5pwd_wipe( slot->sl_password, sizeof( slot->sl_password ) );
+	slot->sl_rc = LDAP_OTHER;
+	slot->sl_kadm5 = 0;
+	slot->sl_keys_len = 0;
+	snprintf( slot->sl_text, sizeof( slot->sl_text ), "%s", text );
+	smbkrb5pwd_lane_release( pool->pl_ring, slot->sl_lane );
+	__atomic_store_n( &slot->sl_state, SMBKRB5PWD_SL_DONE,
+			  __ATOMIC_RELEASE );
+	smbkrb5pwd_futex_wake( &slot->sl_state, INT_MAX );
+}
+
+/* Restart helpers that have exited and fail the requests they held */
+static void
+smbkrb5pwd_pool_reap( smbkrb5pwd_realm *rm )
+{
+	smbkrb5pwd_pool *pool = rm->rm_pool;
+	smbkrb5pwd_slot *slot;
+	uint32_t state;
+	int i, j;
+
+	ldap_pvt_thread_mutex_lock( &pool->pl_mutex );
+	for ( i = 0; i < pool->pl_nhelpers; i++ ) {
+		if ( smbkrb5pwd_helper_alive( &pool->pl_procs[ i ] ) ) {
+			continue;
+		}
+
+		if ( pool->pl_procs[ i ].pr_pid > 0 ) {
+			Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+			     "smbkrb5pwd : kerberos helper %d exited,"
+			     " restarting\n",
+			     (int)pool->pl_procs[ i ].pr_pid);
+		}
+		smbkrb5pwd_helper_forget( &pool->pl_procs[ i ] );
+
+		for ( j = 0; j < SMBKRB5PWD_SLOTS; j++ ) {
+			slot = &pool->pl_ring->rg_slots[ j ];
+			state = __atomic_load_n( &slot->sl_state,
+						 __ATOMIC_ACQUIRE );
+			/* also one it died while finishing */
+			if ( !SMBKRB5PWD_SL_HELD( state ) ||
+			     SMBKRB5PWD_SL_HELPER( state ) != i ) {
+				continue;
+			}
+			smbkrb5pwd_slot_fail( pool, slot, state,
+					      "kerberos helper process died" );
+		}
+
+		smbkrb5pwd_helper_start( rm, i, &pool->pl_procs[ i ] );
+	}
+	ldap_pvt_thread_mutex_unlock( &pool->pl_mutex );
+}
+
+/* Reserve n slots of a lane at once, so that a thread never holds some
+ * slots while it waits for more; n must not exceed ln_slots */
+static void
+smbkrb5pwd_slot_get_n( smbkrb5pwd_pool *pool, int lane,
+	smbkrb5pwd_slot **slots, int n )
+{
+	smbkrb5pwd_slot *slot;
+	int i, k;
+
+	ldap_pvt_thread_mutex_lock( &pool->pl_mutex );
+	pool->pl_waiting[ lane ]++;
+	while ( pool->pl_nfree < n ||
+		pool->pl_inuse[ lane ] + n > smbkrb5pwd_lanes[ lane ].ln_slots ) {
+		ldap_pvt_thread_cond_wait( &pool->pl_cond, &pool->pl_mutex );
+	}
+	pool->pl_waiting[ lane ]--;
+	for ( i = 0, k = 0; i < SMBKRB5PWD_SLOTS && k < n; i++ ) {
+		slot = &pool->pl_ring->rg_slots[ i ];
+		if ( slot->sl_state == SMBKRB5PWD_SL_FREE ) {
+			slot->sl_state = SMBKRB5PWD_SL_RESERVED;
+			slot->sl_lane = lane;
+			slots[ k++ ] = slot;
+		}
+	}
+	pool->pl_nfree -= n;
+	pool->pl_inuse[ lane ] += n;
+	ldap_pvt_thread_mutex_unlock( &pool->pl_mutex );
+
+	for ( k = 0; k < n; k++ ) {
+		slots[ k ]->sl_text[ 0 ] = '\0';
+		slots[ k ]->sl_kadm5 = 0;
+		slots[ k ]->sl_usec = 0;
+		slots[ k ]->sl_kvno = 0;
+		slots[ k ]->sl_keys_len = 0;
+	}
+}
+
+static smbkrb5pwd_slot *
+smbkrb5pwd_slot_get( smbkrb5pwd_pool *pool, int lane )
+{
+	smbkrb5pwd_slot *slot;
+
+	smbkrb5pwd_slot_get_n( pool, lane, &slot, 1 );
+
+	return slot;
+}
+
+static void
+smbkrb5pwd_slot_put( smbkrb5pwd_pool *pool, smbkrb5pwd_slot *slot )
+{
+	smbkrb5pwd_wipe( slot->sl_password, sizeof( slot->sl_password ) );
+	smbkrb5pwd_wipe( slot->sl_keys, slot->sl_keys_len );
+
+	ldap_pvt_thread_mutex_lock( &pool->pl_mutex );
+	__atomic_store_n( &slot->sl_state, SMBKRB5PWD_SL_FREE,
+			  __ATOMIC_RELEASE );
+	pool->pl_nfree++;
+	pool->pl_inuse[ slot->sl_lane ]--;
+	ldap_pvt_thread_cond_broadcast( &pool->pl_cond );
+	ldap_pvt_thread_mutex_unlock( &pool->pl_mutex );
+}
+
+/* Hand n filled slots to the helpers with a single wakeup */
+static void
+smbkrb5pwd_submit( smbkrb5pwd_pool *pool, smbkrb5pwd_slot **slots, int n )
+{
+	smbkrb5pwd_ring *ring = pool->pl_ring;
+	int i;
+
+	for ( i = 0; i < n; i++ ) {
+		__atomic_store_n( &slots[ i ]->sl_state,
+				  SMBKRB5PWD_SL_SUBMITTED, __ATOMIC_RELEASE );
+	}
+
+	__atomic_add_fetch( &ring->rg_seq, 1, __ATOMIC_RELEASE );
+	smbkrb5pwd_futex_wake( &ring->rg_seq,
+			       n < pool->pl_nhelpers ? n : pool->pl_nhelpers );
+}
+
+/* Wait until a submitted slot is done. Helpers that died are restarted
+ * while waiting; a request that no helper picked up in the ln_wait of
+ * its lane fails. Once a helper claimed it, its own SMBKRB5PWD_TIMEOUT
+ * alarm runs; the helper is killed only if it is still busy
+ * SMBKRB5PWD_KILL_GRACE seconds after that, and if it has not gone
+ * SMBKRB5PWD_TIMEOUT seconds later the request fails anyway and the
+ * helper is replaced. Both count from the claim, not from the submit,
+ * so a request that waited long in its lane still gets its full time
+ * in kadm5. */
+#define SMBKRB5PWD_KILL_GRACE	5
+
+static int
+smbkrb5pwd_wait( smbkrb5pwd_realm *rm, smbkrb5pwd_slot *slot )
+{
+	struct timespec tick = { 1, 0 };
+	time_t deadline = time( NULL ) +
+		smbkrb5pwd_lanes[ slot->sl_lane ].ln_wait;
+	time_t kill_at = 0, hard = 0;
+	uint32_t state, claim = 0;
+
+	while ( ( state = __atomic_load_n( &slot->sl_state,
+					   __ATOMIC_ACQUIRE ) )
+		!= SMBKRB5PWD_SL_DONE ) {
+		/* a new claim, e.g. after the first helper died */
+		if ( SMBKRB5PWD_SL_HELD( state ) &&
+		     ( kill_at == 0 || ( ( state ^ claim ) & ~0xffU ) ) ) {
+			claim = state;
+			kill_at = time( NULL ) + SMBKRB5PWD_TIMEOUT +
+				SMBKRB5PWD_KILL_GRACE;
+			hard = kill_at + SMBKRB5PWD_TIMEOUT;
+		}
+
+		if ( smbkrb5pwd_futex_wait( &slot->sl_state, state, &tick ) == 0
+		     || errno != ETIMEDOUT ) {
+			continue;
+		}
+
+		smbkrb5pwd_pool_reap( rm );
+
+		if ( SMBKRB5PWD_SL_HELD( state ) ) {
+			smbkrb5pwd_pool *pool = rm->rm_pool;
+			int i = SMBKRB5PWD_SL_HELPER( state );
+			int give_up = time( NULL ) >= hard;
+
+			if ( time( NULL ) < kill_at ) {
+				continue;
+			}
+
+			/* its alarm should have fired already; not if the
+			 * helper was replaced in the meantime */
+			ldap_pvt_thread_mutex_lock( &pool->pl_mutex );
+			if ( i < pool->pl_nhelpers &&
+			     pool->pl_procs[ i ].pr_epoch ==
+			     SMBKRB5PWD_SL_EPOCH( state ) ) {
+				smbkrb5pwd_helper_signal( &pool->pl_procs[ i ],
+							  SIGKILL );
+				/* stuck even for SIGKILL; the next reap
+				 * starts a new helper with its index, and
+				 * with a new epoch the old one can no longer
+				 * write to the slot */
+				if ( give_up )
+					smbkrb5pwd_helper_forget(
+						&pool->pl_procs[ i ] );
+			}
+			if ( give_up )
+				smbkrb5pwd_slot_fail( pool, slot, state,
+					"kerberos helper does not answer" );
+			ldap_pvt_thread_mutex_unlock( &pool->pl_mutex );
+			continue;
+		}
+
+		if ( time( NULL ) < deadline ) {
+			continue;
+		}
+
+		if ( state == SMBKRB5PWD_SL_SUBMITTED &&
+		     __atomic_compare_exchange_n( &slot->sl_state, &state,
+				SMBKRB5PWD_SL_RESERVED, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) ) {
+			slot->sl_rc = LDAP_BUSY;
+			snprintf( slot->sl_text, sizeof( slot->sl_text ),
+				  "no kerberos helper available" );
+			break;
+		}
+	}
+
+	return slot->sl_rc;
+}
+
+/* Set the helpers each lane may use from the configuration; the
+ * interactive lane may always use all of them */
+static void
+smbkrb5pwd_pool_caps( smbkrb5pwd_t *pi, smbkrb5pwd_pool *pool )
+{
+	smbkrb5pwd_ring *ring = pool->pl_ring;
+	int n = pool->pl_nhelpers, bulk, background;
+
+	bulk = pi->bulk_helpers ? pi->bulk_helpers : n - 1;
+	background = pi->background_helpers ? pi->background_helpers : 1;
+
+	__atomic_store_n( &ring->rg_cap[ SMBKRB5PWD_LANE_INTERACTIVE ], n,
+			  __ATOMIC_RELEASE );
+	__atomic_store_n( &ring->rg_cap[ SMBKRB5PWD_LANE_BULK ],
+			  bulk < 1 ? 1 : bulk > n ? n : bulk,
+			  __ATOMIC_RELEASE );
+	__atomic_store_n( &ring->rg_cap[ SMBKRB5PWD_LANE_BACKGROUND ],
+			  background > n ? n : background, __ATOMIC_RELEASE );
+
+	/* a lane may have been waiting for its cap to grow */
+	__atomic_add_fetch( &ring->rg_seq, 1, __ATOMIC_RELEASE );
+	smbkrb5pwd_futex_wake( &ring->rg_seq, INT_MAX );
+}
+
+static int
+smbkrb5pwd_pool_start( smbkrb5pwd_realm *rm )
+{
+	smbkrb5pwd_pool *pool;
+	smbkrb5pwd_ring *ring;
+	int fd, i;
+
+	fd = memfd_create( "smbkrb5pwd", MFD_CLOEXEC );
+	if ( fd == -1 || ftruncate( fd, sizeof( smbkrb5pwd_ring ) ) == -1 ) {
+		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd : could not create kerberos helper ring: %s\n",
+		     strerror(errno));
+		if ( fd != -1 )
+			close( fd );
+		return LDAP_OTHER;
+	}
+
+	ring = mmap( NULL, sizeof( smbkrb5pwd_ring ), PROT_READ|PROT_WRITE,
+		     MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( ring == MAP_FAILED ) {
+		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd : could not map kerberos helper ring: %s\n",
+		     strerror(errno));
+		return LDAP_OTHER;
+	}
+
+	/* passwords pass through the ring: keep it out of swap and cores */
+	if ( mlock( ring, sizeof( smbkrb5pwd_ring ) ) ) {
+		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
+		     "smbkrb5pwd : could not lock kerberos helper ring: %s\n",
+		     strerror(errno));
+	}
+	madvise( ring, sizeof( smbkrb5pwd_ring ), MADV_DONTDUMP );
+
+	pool = ch_calloc( 1, sizeof( smbkrb5pwd_pool ) );
+	pool->pl_ring = ring;
+	pool->pl_nhelpers = rm->rm_pi->helpers;
+	pool->pl_procs = ch_calloc( pool->pl_nhelpers,
+				    sizeof( smbkrb5pwd_proc ) );
+	ring->rg_nhelpers = pool->pl_nhelpers;
+	pool->pl_nfree = SMBKRB5PWD_SLOTS;
+	ldap_pvt_thread_mutex_init( &pool->pl_mutex );
+	ldap_pvt_thread_cond_init( &pool->pl_cond );
+	smbkrb5pwd_pool_caps( rm->rm_pi, pool );
+
+	rm->rm_pool = pool;
+	for ( i = 0; i < pool->pl_nhelpers; i++ ) {
+		smbkrb5pwd_helper_start( rm, i, &pool->pl_procs[ i ] );
+	}
+
+	return LDAP_SUCCESS;
+}
+
+static void
+smbkrb5pwd_pool_stop( smbkrb5pwd_realm *rm )
+{
+	smbkrb5pwd_pool *pool = rm->rm_pool;
+	smbkrb5pwd_ring *ring;
+	int i;
+
+	if ( pool == NULL ) {
+		return;
+	}
+	rm->rm_pool = NULL;
+	ring = pool->pl_ring;
+
+	__atomic_store_n( &ring->rg_shutdown, 1, __ATOMIC_RELEASE );
+	__atomic_add_fetch( &ring->rg_seq, 1, __ATOMIC_RELEASE );
+	smbkrb5pwd_futex_wake( &ring->rg_seq, INT_MAX );
+
+	for ( i = 0; i < pool->pl_nhelpers; i++ ) {
+		smbkrb5pwd_helper_stop( &pool->pl_procs[ i ] );
+	}
+
+	smbkrb5pwd_wipe( ring, sizeof( smbkrb5pwd_ring ) );
+	munmap( ring, sizeof( smbkrb5pwd_ring ) );
+
+	ldap_pvt_thread_cond_destroy( &pool->pl_cond );
+	ldap_pvt_thread_mutex_destroy( &pool->pl_mutex );
+	ch_free( pool->pl_procs );
+	ch_free( pool );
+}
+
+/* Change the number of helpers of a running pool. The ring, the
+ * remaining helpers and their kadm5 sessions stay; new helpers open
+ * their session with their first request. Called from back-config with
+ * the thread pool paused, so no slot is in use. */
+static void
+smbkrb5pwd_pool_resize( smbkrb5pwd_realm *rm, int n )
+{
+	smbkrb5pwd_pool *pool = rm->rm_pool;
+	smbkrb5pwd_ring *ring;
+	int i, old;
+
+	if ( pool == NULL || n == pool->pl_nhelpers ) {
+		return;
+	}
+	ring = pool->pl_ring;
+	old = pool->pl_nhelpers;
+
+	ldap_pvt_thread_mutex_lock( &pool->pl_mutex );
+	if ( n > old ) {
+		pool->pl_procs = ch_realloc( pool->pl_procs,
+					     n * sizeof( smbkrb5pwd_proc ) );
+		__atomic_store_n( &ring->rg_nhelpers, n, __ATOMIC_RELEASE );
+		for ( i = old; i < n; i++ ) {
+			smbkrb5pwd_helper_start( rm, i, &pool->pl_procs[ i ] );
+		}
+		pool->pl_nhelpers = n;
+		ldap_pvt_thread_mutex_unlock( &pool->pl_mutex );
+	} else {
+		/* the helpers from n on see rg_nhelpers when woken */
+		pool->pl_nhelpers = n;
+		ldap_pvt_thread_mutex_unlock( &pool->pl_mutex );
+		__atomic_store_n( &ring->rg_nhelpers, n, __ATOMIC_RELEASE );
+		__atomic_add_fetch( &ring->rg_seq, 1, __ATOMIC_RELEASE );
+		smbkrb5pwd_futex_wake( &ring->rg_seq, INT_MAX );
+		for ( i = n; i < old; i++ ) {
+			smbkrb5pwd_helper_stop( &pool->pl_procs[ i ] );
+		}
+	}
+
+	Log3(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO,
+	     "smbkrb5pwd : %s now has %d kerberos helpers (was %d)\n",
+	     rm->rm_name, n, old);
+
+	smbkrb5pwd_pool_caps( rm->rm_pi, pool );
+}
+
+/* Open the kadm5 session of every helper */
+static int
+smbkrb5pwd_pool_init_sessions( smbkrb5pwd_realm *rm )
+{
+	smbkrb5pwd_slot *slots[ SMBKRB5PWD_SLOTS ];
+	int i, n = rm->rm_pool->pl_nhelpers, rc = LDAP_SUCCESS;
+
+	for ( i = 0; i < n; i++ ) {
+		slots[ i ] = smbkrb5pwd_slot_get( rm->rm_pool,
+					SMBKRB5PWD_LANE_INTERACTIVE );
+		slots[ i ]->sl_req = SMBKRB5PWD_REQ_INIT;
+		slots[ i ]->sl_connid = 0;
+		slots[ i ]->sl_opid = 0;
+	}
+
+	smbkrb5pwd_submit( rm->rm_pool, slots, n );
+
+	for ( i = 0; i < n; i++ ) {
+		if ( smbkrb5pwd_wait( rm, slots[ i ] ) != LDAP_SUCCESS ) {
+			rc = slots[ i ]->sl_rc;
+		}
+		smbkrb5pwd_slot_put( rm->rm_pool, slots[ i ] );
+	}
+
+	return rc;
+}
+
+/* Copy the diagnostic of a failed request to memory of the operation */
+static const char *
+smbkrb5pwd_slot_text( Operation *op, smbkrb5pwd_slot *slot )
+{
+	char *text;
+	size_t len = strlen( slot->sl_text );
+
+	if ( len == 0 ) {
+		return NULL;
+	}
+
+	text = op->o_tmpalloc( len + 1, op->o_tmpmemctx );
+	memcpy( text, slot->sl_text, len + 1 );
+
+	return text;
+}
+
+static int
+smbkrb5pwd_get_state( smbkrb5pwd_realm *rm )
+{
+	int state;
+
+	ldap_pvt_thread_mutex_lock( &rm->rm_pi->krb5_mutex );
+	state = rm->rm_state;
+	ldap_pvt_thread_mutex_unlock( &rm->rm_pi->krb5_mutex );
+
+	return state;
+}
+
+static void
+smbkrb5pwd_set_state( smbkrb5pwd_realm *rm, int state )
+{
+	ldap_pvt_thread_mutex_lock( &rm->rm_pi->krb5_mutex );
+	rm->rm_state = state;
+	ldap_pvt_thread_mutex_unlock( &rm->rm_pi->krb5_mutex );
+}
+
+static int
+smbkrb5pwd_realm_cmp( const void *v_a, const void *v_b )
+{
+	const smbkrb5pwd_realm *a = *(const smbkrb5pwd_realm **)v_a;
+	const smbkrb5pwd_realm *b = *(const smbkrb5pwd_realm **)v_b;
+
+	return strcmp( a->rm_name, b->rm_name );
+}
+
+/* deepest base first, so that the first suffix match wins */
+static int
+smbkrb5pwd_route_cmp( const void *v_a, const void *v_b )
+{
+	const smbkrb5pwd_route *a = v_a, *b = v_b;
+
+	return (int)b->rt_ndn.bv_len - (int)a->rt_ndn.bv_len;
+}
+
+static smbkrb5pwd_realm *
+smbkrb5pwd_realm_find( smbkrb5pwd_t *pi, struct berval *name )
+{
+	int lo = 0, hi = pi->nrealms - 1, mid, cmp;
+
+	while ( lo <= hi ) {
+		mid = ( lo + hi ) / 2;
+		cmp = strncmp( name->bv_val, pi->realms[mid]->rm_name,
+			       name->bv_len );
+		if ( cmp == 0 && pi->realms[mid]->rm_name[name->bv_len] != '\0' )
+			cmp = -1;
+		if ( cmp == 0 )
+			return pi->realms[mid];
+		if ( cmp < 0 )
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+/* The realm of the principal of e: the value of olcSmbKrb5PwdRealmAttr,
+ * else the realm of the deepest olcSmbKrb5PwdRealmMap base above e,
+ * else olcSmbKrb5PwdKrb5Realm. */
+static smbkrb5pwd_realm *
+smbkrb5pwd_realm_route( Operation *op, smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf, Entry *e, const char **text )
+{
+	Attribute *a;
+	int i;
+
+	if ( cf->realm_attr &&
+	     ( a = attr_find( e->e_attrs, cf->realm_attr ) ) != NULL ) {
+		smbkrb5pwd_realm *rm = smbkrb5pwd_realm_find( pi, &a->a_vals[0] );
+
+		if ( rm == NULL ) {
+			Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+			     "smbkrb5pwd %s : realm %s of %s is not"
+			     " configured\n", op->o_log_prefix,
+			     a->a_vals[0].bv_val, e->e_name.bv_val);
+			*text = "kerberos realm of the entry is not configured";
+		}
+		return rm;
+	}
+
+	for ( i = 0; i < pi->nroutes; i++ ) {
+		if ( dnIsSuffix( &e->e_nname, &pi->routes[i].rt_ndn ) )
+			return pi->routes[i].rt_realm;
+	}
+
+	if ( pi->default_realm == NULL )
+		*text = "no kerberos realm for the entry";
+
+	return pi->default_realm;
+}
+
+/* Prepend a replace of ad with the value bv, whose memory is taken
+ * over, to the modification list; no value deletes the attribute */
+static Modifications *
+smbkrb5pwd_bv_mod( AttributeDescription *ad, struct berval *bv,
+	Modifications *next )
+{
+	Modifications *ml;
+	struct berval *keys = NULL;
+
+	ml = ch_malloc(sizeof(Modifications));
+	ml->sml_next = next;
+
+	if ( bv ) {
+		keys = ch_malloc( 2 * sizeof(struct berval) );
+		keys[0] = *bv;
+		BER_BVZERO( &keys[1] );
+	}
+
+	ml->sml_desc = ad;
+	ml->sml_type = ad->ad_cname;
+	ml->sml_op = LDAP_MOD_REPLACE;
+#ifdef SLAP_MOD_INTERNAL
+	ml->sml_flags = SLAP_MOD_INTERNAL;
+#endif
+	ml->sml_numvals = bv ? 1 : 0;
+	ml->sml_values = keys;
+	ml->sml_nvalues = NULL;
+
+	return ml;
+}
+
+/* Prepend a replace of ad with the integer l to the modification list */
+static Modifications *
+smbkrb5pwd_long_mod( AttributeDescription *ad, long l, Modifications *next )
+{
+	struct berval bv;
+
+	bv.bv_val = ch_malloc( LDAP_PVT_INTTYPE_CHARS(long) );
+	bv.bv_len = snprintf(bv.bv_val,
+		LDAP_PVT_INTTYPE_CHARS(long),
+		"%ld", l);
+
+	return smbkrb5pwd_bv_mod( ad, &bv, next );
+}
+
+/* Prepend a replace of ad with the time t to the modification list */
+static Modifications *
+smbkrb5pwd_time_mod( AttributeDescription *ad, time_t t, Modifications *next )
+{
+	return smbkrb5pwd_long_mod( ad, (long)t, next );
+}
+
+/* The integer value of ad in e, 0 if it has none */
+static long
+smbkrb5pwd_attr_long( Entry *e, AttributeDescription *ad )
+{
+	Attribute *a;
+	long l;
+
+	a = attr_find( e->e_attrs, ad );
+	if ( a == NULL || lutil_atol( &l, a->a_vals[0].bv_val ) != 0 )
+		return 0;
+	return l;
+}
+
+#ifdef SMBKRB5PWD_KADM5_SRV
+/* Prepend a replace of ad with t as GeneralizedTime */
+static Modifications *
+smbkrb5pwd_gentime_mod( AttributeDescription *ad, time_t t,
+	Modifications *next )
+{
+	struct berval bv;
+
+	bv.bv_val = ch_malloc( LDAP_LUTIL_GENTIME_BUFSIZE );
+	bv.bv_len = LDAP_LUTIL_GENTIME_BUFSIZE;
+	slap_timestamp( &t, &bv );
+
+	return smbkrb5pwd_bv_mod( ad, &bv, next );
+}
+
+/* The password policy of an LDAP KDB principal, krbPwdPolicy */
+typedef struct smbkrb5pwd_krb5_policy {
+	long	kp_max_life;
+	long	kp_min_length;
+	long	kp_min_classes;
+} smbkrb5pwd_krb5_policy;
+
+/* Read the policy of the principal e. Returns -1 if the change must be
+ * left to kadm5: the policy cannot be read here, or it keeps a password
+ * history, which only kadm5 can check. */
+static int
+smbkrb5pwd_inline_policy( Operation *op, Entry *e, smbkrb5pwd_krb5_policy *kp )
+{
+	Attribute *a;
+	Entry *pe;
+	int rc = 0;
+
+	memset( kp, 0, sizeof( *kp ) );
+
+	a = attr_find( e->e_attrs, ad_krbPwdPolicyReference );
+	if ( a == NULL )
+		return 0;
+
+	if ( be_entry_get_rw( op, &a->a_nvals[0], NULL, NULL, 0, &pe )
+	     != LDAP_SUCCESS ) {
+		Log2(LDAP_DEBUG_TRACE, LDAP_LEVEL_NOTICE,
+		     "smbkrb5pwd %s : cannot read policy %s, using kadm5\n",
+		     op->o_log_prefix, a->a_vals[0].bv_val);
+		return -1;
+	}
+
+	kp->kp_max_life = smbkrb5pwd_attr_long( pe, ad_krbMaxPwdLife );
+	kp->kp_min_length = smbkrb5pwd_attr_long( pe, ad_krbMinPwdLength );
+	kp->kp_min_classes = smbkrb5pwd_attr_long( pe, ad_krbMinPwdClasses );
+
+	/* Anything else the policy asks for is left to kadm5: the password
+	 * history, the minimum password life and restricted key/salt types
+	 * are not enforced here. */
+	if ( smbkrb5pwd_attr_long( pe, ad_krbPwdHistoryLength ) > 1 ||
+	     smbkrb5pwd_attr_long( pe, ad_krbMinPwdLife ) > 0 ||
+	     ( ad_krbPwdAllowedKeysalts != NULL &&
+	       attr_find( pe->e_attrs, ad_krbPwdAllowedKeysalts ) != NULL ) ) {
+		Log2(LDAP_DEBUG_TRACE, LDAP_LEVEL_INFO,
+		     "smbkrb5pwd %s : policy %s needs kadm5\n",
+		     op->o_log_prefix, a->a_vals[0].bv_val);
+		rc = -1;
+	}
+
+	be_entry_release_r( op, pe );
+
+	return rc;
+}
+
+/* The length and character class checks of kadm5 */
+static int
+smbkrb5pwd_inline_quality( struct berval *pw, smbkrb5pwd_krb5_policy *kp,
+	const char **text )
+{
+	int lower = 0, upper = 0, digit = 0, punct = 0, other = 0;
+	ber_len_t i;
+	unsigned char c;
+
+	if ( (long)pw->bv_len < kp->kp_min_length ) {
+		*text = "Password is too short";
+		return LDAP_CONSTRAINT_VIOLATION;
+	}
+
+	for ( i = 0; i < pw->bv_len; i++ ) {
+		c = pw->bv_val[i];
+		if ( islower( c ) )
+			lower = 1;
+		else if ( isupper( c ) )
+			upper = 1;
+		else if ( isdigit( c ) )
+			digit = 1;
+		else if ( ispunct( c ) )
+			punct = 1;
+		else
+			other = 1;
+	}
+
+	if ( lower + upper + digit + punct + other < kp->kp_min_classes ) {
+		*text = "Password does not contain enough character classes";
+		return LDAP_CONSTRAINT_VIOLATION;
+	}
+
+	return LDAP_SUCCESS;
+}
+
+/* The highest key version in krbPrincipalKey. The values are only
+ * decoded here; the memory comes from malloc() of the codec. */
+static uint32_t
+smbkrb5pwd_inline_kvno( Attribute *a )
+{
+	smbkrb5pwd_seqof_key_data *seq;
+	krb5_data in;
+	uint32_t kvno = 0;
+	int i, j;
+
+	for ( i = 0; a && i < a->a_numvals; i++ ) {
+		in.length = a->a_vals[i].bv_len;
+		in.data = a->a_vals[i].bv_val;
+		if ( krb5int_ldap_decode_sequence_of_keys( &in, &seq ) != 0 )
+			continue;
+		for ( j = 0; j < seq->n_key_data; j++ ) {
+			if ( seq->key_data[j].key_data_kvno > kvno )
+				kvno = seq->key_data[j].key_data_kvno;
+			free( seq->key_data[j].key_data_contents[0] );
+			free( seq->key_data[j].key_data_contents[1] );
+		}
+		free( seq->key_data );
+		free( seq );
+	}
+
+	return kvno;
+}
+#endif
+
+/*
+ * Principal names
+ *
+ * olcSmbKrb5PwdPrincipal is a template such as "%{uid}@%{realm}" (the
+ * default), "%{uid}/student@%{realm}" or "%{mail:local:lower}@%{realm}".
+ * %{attr} is the first value of an attribute of the entry, with the
+ * modifiers :local (up to the first '@') and :lower (ASCII lower case);
+ * %{realm} is the realm the entry is routed to and %% is a '%'. It is
+ * compiled once by smbkrb5pwd_princ_compile() and rendered for every
+ * change into the fixed buffer of the request, which the helper parses
+ * with krb5_parse_name(). The template must end in "@%{realm}", so that
+ * the realm is the last component (see smbkrb5pwd_shadow_mirror()).
+ */
+static void
+smbkrb5pwd_princ_free( smbkrb5pwd_princ_map *pm )
+{
+	if ( pm == NULL )
+		return;
+	ch_free( pm->pm_template );
+	ch_free( pm );
+}
+
+/* Compile tmpl into *pmp; on error a message is left in err */
+static int
+smbkrb5pwd_princ_compile( const char *tmpl, smbkrb5pwd_princ_map **pmp,
+	char *err, size_t errlen )
+{
+	smbkrb5pwd_princ_map *pm;
+	smbkrb5pwd_princ_op *po;
+	char *p, *end, *mod, name[ 64 ];
+	size_t len = strlen( tmpl );
+	const char *text;
+
+	/* every op takes at least one character of the template */
+	pm = ch_calloc( 1, sizeof( smbkrb5pwd_princ_map )
+		+ len * sizeof( smbkrb5pwd_princ_op ) );
+	pm->pm_template = ch_strdup( tmpl );
+
+	for ( p = pm->pm_template; *p; ) {
+		po = &pm->pm_ops[ pm->pm_nops++ ];
+
+		if ( *p != '%' ) {
+			po->po_type = SMBKRB5PWD_PO_TEXT;
+			po->po_text.bv_val = p;
+			while ( *p && *p != '%' )
+				p++;
+			po->po_text.bv_len = p - po->po_text.bv_val;
+			continue;
+		}
+
+		if ( p[ 1 ] == '%' ) {
+			po->po_type = SMBKRB5PWD_PO_TEXT;
+			po->po_text.bv_val = p;
+			po->po_text.bv_len = 1;
+			p += 2;
+			continue;
+		}
+
+		if ( p[ 1 ] != '{' || ( end = strchr( p, '}' ) ) == NULL ||
+		     end - p - 2 >= (ptrdiff_t)sizeof( name ) ) {
+			snprintf( err, errlen, "invalid %% at \"%s\"", p );
+			goto fail;
+		}
+		memcpy( name, p + 2, end - p - 2 );
+		name[ end - p - 2 ] = '\0';
+		p = end + 1;
+
+		if ( ( mod = strchr( name, ':' ) ) != NULL )
+			*mod++ = '\0';
+		while ( mod ) {
+			char *next = strchr( mod, ':' );
+
+			if ( next )
+				*next++ = '\0';
+			if ( !strcasecmp( mod, "lower" ) ) {
+				po->po_flags |= SMBKRB5PWD_PO_LOWER;
+			} else if ( !strcasecmp( mod, "local" ) ) {
+				po->po_flags |= SMBKRB5PWD_PO_LOCAL;
+			} else {
+				snprintf( err, errlen, "unknown modifier \"%s\"",
+					  mod );
+				goto fail;
+			}
+			mod = next;
+		}
+
+		if ( !strcasecmp( name, "realm" ) ) {
+			if ( po->po_flags ) {
+				snprintf( err, errlen,
+					  "%%{realm} takes no modifiers" );
+				goto fail;
+			}
+			po->po_type = SMBKRB5PWD_PO_REALM;
+			continue;
+		}
+
+		po->po_type = SMBKRB5PWD_PO_ATTR;
+		if ( slap_str2ad( name, &po->po_ad, &text ) != LDAP_SUCCESS ) {
+			snprintf( err, errlen, "unknown attribute \"%s\"", name );
+			goto fail;
+		}
+	}
+
+	if ( pm->pm_nops < 2 ||
+	     pm->pm_ops[ pm->pm_nops - 1 ].po_type != SMBKRB5PWD_PO_REALM ||
+	     pm->pm_ops[ pm->pm_nops - 2 ].po_type != SMBKRB5PWD_PO_TEXT ||
+	     pm->pm_ops[ pm->pm_nops - 2 ].po_text.bv_val[
+			pm->pm_ops[ pm->pm_nops - 2 ].po_text.bv_len - 1 ] != '@' ) {
+		snprintf( err, errlen, "must end in \"@%%{realm}\"" );
+		goto fail;
+	}
+
+	*pmp = pm;
+	return 0;
+
+fail:
+	smbkrb5pwd_princ_free( pm );
+	return -1;
+}
+
+/* Render the principal of e in realm into buf. Characters of attribute
+ * values that krb5_parse_name() would take as separators are escaped.
+ * Returns the length, -1 if it does not fit or -2 if the entry lacks
+ * an attribute, which is then left in *missing. */
+static int
+smbkrb5pwd_princ_render(
+	smbkrb5pwd_princ_map *pm,
+	Entry *e,
+	const char *realm,
+	char *buf,
+	size_t size,
+	AttributeDescription **missing )
+{
+	smbkrb5pwd_princ_op *po;
+	Attribute *a;
+	size_t n = 0;
+	ber_len_t j, len;
+	int i;
+	char c;
+
+	for ( i = 0; i < pm->pm_nops; i++ ) {
+		po = &pm->pm_ops[ i ];
+
+		switch ( po->po_type ) {
+		case SMBKRB5PWD_PO_TEXT:
+			if ( n + po->po_text.bv_len >= size )
+				return -1;
+			memcpy( buf + n, po->po_text.bv_val, po->po_text.bv_len );
+			n += po->po_text.bv_len;
+			break;
+
+		case SMBKRB5PWD_PO_REALM:
+			len = strlen( realm );
+			if ( n + len >= size )
+				return -1;
+			memcpy( buf + n, realm, len );
+			n += len;
+			break;
+
+		case SMBKRB5PWD_PO_ATTR:
+			if ( ( a = attr_find( e->e_attrs, po->po_ad ) ) == NULL ||
+			     BER_BVISEMPTY( &a->a_vals[ 0 ] ) ) {
+				*missing = po->po_ad;
+				return -2;
+			}
+			for ( j = 0; j < a->a_vals[ 0 ].bv_len; j++ ) {
+				c = a->a_vals[ 0 ].bv_val[ j ];
+				if ( c == '@' && ( po->po_flags & SMBKRB5PWD_PO_LOCAL ) )
+					break;
+				if ( po->po_flags & SMBKRB5PWD_PO_LOWER )
+					c = tolower( (unsigned char)c );
+				if ( c == '@' || c == '/' || c == '\\' ) {
+					if ( n + 1 >= size )
+						return -1;
+					buf[ n++ ] = '\\';
 				}
+				if ( n + 1 >= size )
+					return -1;
+				buf[ n++ ] = c;
+			}
+			break;
+		}
+	}
+	buf[ n ] = '\0';
+
+	return n;
+}
+
+/* A kerberos change between smbkrb5pwd_krb5_prepare() and the helper */
+typedef struct smbkrb5pwd_krb5_req {
+	smbkrb5pwd_realm	*kr_realm;
+	char			kr_princ[ SMBKRB5PWD_PRINC_MAX ];
+	int			kr_inline;	/* SMBKRB5PWD_REQ_KEYS */
+	uint32_t		kr_kvno;
+#ifdef SMBKRB5PWD_KADM5_SRV
+	smbkrb5pwd_krb5_policy	kr_policy;
+#endif
+} smbkrb5pwd_krb5_req;
+
+/* Check that the kerberos password of e may be set to pw and find the
+ * realm and principal; nothing is sent to the helpers yet */
+static int
+smbkrb5pwd_krb5_prepare(
+	Operation *op,
+	smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf,
+	Entry *e,
+	struct berval *pw,
+	smbkrb5pwd_krb5_req *kr,
+	const char **text)
+{
+	Attribute *a_name = NULL;
+	AttributeDescription *missing = NULL;
+	smbkrb5pwd_realm *rm;
+	int len;
+	struct timespec ts;
+
+	memset(kr, 0, sizeof(*kr));
+
+	SMBKRB5PWD_PROBE_OP(SMBKRB5PWD_PH_ACL, op, e->e_nname.bv_val);
+	smbkrb5pwd_trace_begin(&ts);
+	if (!access_allowed(op, e, slap_schema.si_ad_userPassword, NULL,
+			    ACL_WRITE, NULL)) {
+		smbkrb5pwd_trace(pi, op, SMBKRB5PWD_PH_ACL, &ts, 0,
+				 LDAP_INSUFFICIENT_ACCESS);
+		return LDAP_INSUFFICIENT_ACCESS;
+	}
+	smbkrb5pwd_trace(pi, op, SMBKRB5PWD_PH_ACL, &ts, 0, LDAP_SUCCESS);
+
+	rm = smbkrb5pwd_realm_route(op, pi, cf, e, text);
+	if (rm == NULL)
+		return LDAP_UNWILLING_TO_PERFORM;
+
+	if (smbkrb5pwd_get_state(rm) != SMBKRB5PWD_S_READY ||
+	    rm->rm_pool == NULL) {
+		*text = "kerberos backend is not ready yet";
+		return LDAP_BUSY;
+	}
+
+#ifdef SMBKRB5PWD_KADM5_SRV
+	/* With the LDAP KDB the user entry can be the principal itself. Its
+	 * new keys are then written by the same modify as the other
+	 * passwords, instead of kadm5 writing them back to this slapd. */
+	if (cf->krb5_inline &&
+	    is_entry_objectclass(e, oc_krbPrincipalAux, 0) &&
+	    (a_name = attr_find(e->e_attrs, ad_krbPrincipalName)) != NULL &&
+	    smbkrb5pwd_inline_policy(op, e, &kr->kr_policy) == 0) {
+		if (smbkrb5pwd_inline_quality(pw, &kr->kr_policy, text)
+		    != LDAP_SUCCESS)
+			return LDAP_CONSTRAINT_VIOLATION;
+		kr->kr_inline = 1;
+		kr->kr_kvno = smbkrb5pwd_inline_kvno(
+			attr_find(e->e_attrs, ad_krbPrincipalKey));
+	}
+#endif
+
+	if (pw->bv_len >= SMBKRB5PWD_PW_MAX) {
+		*text = "password is too long";
+		return LDAP_CONSTRAINT_VIOLATION;
+	}
+
+	/* the principal of the user, from olcSmbKrb5PwdPrincipal */
+	if (kr->kr_inline)
+		len = snprintf(kr->kr_princ, sizeof(kr->kr_princ), "%.*s",
+			       (int)a_name->a_vals[0].bv_len,
+			       a_name->a_vals[0].bv_val);
+	else
+		len = smbkrb5pwd_princ_render(cf->princ_map, e, rm->rm_name,
+					      kr->kr_princ,
+					      sizeof(kr->kr_princ), &missing);
+	if (len == -2) {
+		Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		      "smbkrb5pwd %s : could not find %s in entry: %s\n",
+		      op->o_log_prefix, missing->ad_cname.bv_val,
+		      ldap_err2string(LDAP_NO_SUCH_ATTRIBUTE));
+		return LDAP_NO_SUCH_ATTRIBUTE;
+	}
+	if (len < 0 || (size_t)len >= sizeof(kr->kr_princ)) {
+		*text = "kerberos principal name is too long";
+		return LDAP_CONSTRAINT_VIOLATION;
+	}
+
+	kr->kr_realm = rm;
+
+	return LDAP_SUCCESS;
+}
+
+/* Copy a prepared change into a reserved slot */
+static void
+smbkrb5pwd_krb5_fill(
+	Operation *op,
+	smbkrb5pwd_krb5_req *kr,
+	struct berval *pw,
+	smbkrb5pwd_slot *slot)
+{
+	memcpy(slot->sl_princ, kr->kr_princ, sizeof(slot->sl_princ));
+	memcpy(slot->sl_password, pw->bv_val, pw->bv_len);
+	slot->sl_password[pw->bv_len] = '\0';
+	slot->sl_req = kr->kr_inline ?
+		SMBKRB5PWD_REQ_KEYS : SMBKRB5PWD_REQ_SETPW;
+	slot->sl_kvno = kr->kr_kvno;
+	slot->sl_connid = op->o_connid;
+	slot->sl_opid = op->o_opid;
+}
+
+/* Prepend the modifications a successful change needs in the entry
+ * itself, i.e. the keys of SMBKRB5PWD_REQ_KEYS */
+static void
+smbkrb5pwd_krb5_mods(
+	smbkrb5pwd_krb5_req *kr,
+	smbkrb5pwd_slot *slot,
+	Modifications **mods,
+	Modifications ***modtail)
+{
+#ifdef SMBKRB5PWD_KADM5_SRV
+	Modifications *ml;
+	struct berval keys;
+	time_t now;
+
+	if (!kr->kr_inline)
+		return;
+
+	now = slap_get_time();
+
+	keys.bv_len = slot->sl_keys_len;
+	keys.bv_val = ch_malloc(keys.bv_len + 1);
+	memcpy(keys.bv_val, slot->sl_keys, keys.bv_len);
+	keys.bv_val[keys.bv_len] = '\0';
+
+	ml = smbkrb5pwd_bv_mod(ad_krbPrincipalKey, &keys, *mods);
+	if (!*modtail) *modtail = &ml->sml_next;
+	*mods = smbkrb5pwd_gentime_mod(ad_krbLastPwdChange, now, ml);
+	if (kr->kr_policy.kp_max_life > 0)
+		*mods = smbkrb5pwd_gentime_mod(ad_krbPasswordExpiration,
+			now + kr->kr_policy.kp_max_life, *mods);
+	else
+		*mods = smbkrb5pwd_bv_mod(ad_krbPasswordExpiration, NULL,
+					  *mods);
+#endif
+}
+
+/*
+ * Shadow mirroring
+ *
+ * With olcSmbKrb5PwdShadowRealm every successful kerberos change is
+ * repeated in a second realm, or the same realm on another admin
+ * server, e.g. to load a new KDC with real traffic before migrating to
+ * it. The changes are queued and replayed by smbkrb5pwd_shadow() with
+ * helpers of their own, so the shadow never delays or fails the LDAP
+ * operation; when it falls behind the queue is full and further changes
+ * are dropped and counted. The time the helpers of both sides took is
+ * kept side by side in olmSmbKrb5PwdShadow.
+ */
+typedef struct smbkrb5pwd_shadow_ent {
+	struct smbkrb5pwd_shadow_ent	*se_next;
+	char		se_princ[ SMBKRB5PWD_PRINC_MAX ];
+	struct berval	se_pw;
+	unsigned long	se_connid;
+	unsigned long	se_opid;
+} smbkrb5pwd_shadow_ent;
+
+static void
+smbkrb5pwd_shadow_ent_free( smbkrb5pwd_shadow_ent *se )
+{
+	smbkrb5pwd_wipe( se->se_pw.bv_val, se->se_pw.bv_len );
+	ch_free( se->se_pw.bv_val );
+	ch_free( se );
+}
+
+/* Account a change that a helper of one side finished */
+static void
+smbkrb5pwd_shadow_stat( smbkrb5pwd_t *pi, int side, smbkrb5pwd_slot *slot,
+	int rc )
+{
+	smbkrb5pwd_shadow_stats *ss = &pi->shadow_stats[ side ];
+	unsigned long usec = slot->sl_usec;
+	int b;
+
+	for ( b = 0; b < SMBKRB5PWD_SHADOW_BUCKETS - 1 && ( usec >> b ) > 1; b++ )
+		;
+
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	ss->ss_changes++;
+	if ( rc != LDAP_SUCCESS )
+		ss->ss_errors++;
+	ss->ss_usec += usec;
+	if ( usec > ss->ss_max )
+		ss->ss_max = usec;
+	ss->ss_hist[ b ]++;
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+}
+
+/* Account the primary change of kr and, if it succeeded, queue it for
+ * the shadow; never fails the operation */
+static void
+smbkrb5pwd_shadow_mirror(
+	Operation *op,
+	smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf,
+	smbkrb5pwd_krb5_req *kr,
+	struct berval *pw,
+	smbkrb5pwd_slot *slot,
+	int rc )
+{
+	smbkrb5pwd_realm *shadow = pi->shadow_realm;
+	smbkrb5pwd_shadow_ent *se;
+	char *at;
+	int len;
+
+	/* the same admin server would see every change twice */
+	if ( shadow == NULL || ( shadow->rm_admin_server == NULL &&
+	     !strcmp( shadow->rm_name, kr->kr_realm->rm_name ) ) )
+		return;
+
+	smbkrb5pwd_shadow_stat( pi, SMBKRB5PWD_SHADOW_PRIMARY, slot, rc );
+	if ( rc != LDAP_SUCCESS )
+		return;
+
+	se = ch_calloc( 1, sizeof( smbkrb5pwd_shadow_ent ) );
+	at = strrchr( kr->kr_princ, '@' );
+	len = snprintf( se->se_princ, sizeof( se->se_princ ), "%.*s@%s",
+			at ? (int)( at - kr->kr_princ ) : (int)strlen( kr->kr_princ ),
+			kr->kr_princ, shadow->rm_name );
+	ber_dupbv( &se->se_pw, pw );
+	se->se_connid = op->o_connid;
+	se->se_opid = op->o_opid;
+
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	if ( len < 0 || (size_t)len >= sizeof( se->se_princ ) ||
+	     pi->shadow_nqueue >= cf->shadow_max ) {
+		pi->shadow_dropped++;
+	} else {
+		*pi->shadow_tail = se;
+		pi->shadow_tail = &se->se_next;
+		pi->shadow_nqueue++;
+		se = NULL;
+	}
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+
+	if ( se )
+		smbkrb5pwd_shadow_ent_free( se );
+}
+
+/*
+ * Retried changes
+ *
+ * A client that times out on a change often retries it with the same
+ * password while, or just after, the first attempt went through. With
+ * olcSmbKrb5PwdDedupeTTL the last kerberos change applied to each
+ * principal is remembered for that many seconds, and an identical
+ * change within that time skips kerberos; the LDAP side of it is still
+ * done. The table has olcSmbKrb5PwdDedupeSize entries, indexed by a MAC
+ * of the principal, so it never grows and a newer change of a principal
+ * always replaces the older one. The entries hold HMAC-SHA256 values
+ * with a random key that only lives in slapd's memory.
+ */
+static int
+smbkrb5pwd_dedupe_mac(
+	smbkrb5pwd_t *pi,
+	const char *princ,
+	struct berval *pw,
+	unsigned char *out )
+{
+	char buf[ SMBKRB5PWD_PRINC_MAX + SMBKRB5PWD_PW_MAX ];
+	size_t len = strlen( princ ) + 1;
+	int rc = 0;
+
+	/* the NUL keeps "a" + "bc" apart from "ab" + "c" */
+	memcpy( buf, princ, len );
+	if ( pw ) {
+		memcpy( buf + len, pw->bv_val, pw->bv_len );
+		len += pw->bv_len;
+	}
+
+#ifndef HAVE_GNUTLS
+	{
+		unsigned int outlen = SMBKRB5PWD_MAC_LEN;
+
+		if ( HMAC( EVP_sha256(), pi->dedupe_key, SMBKRB5PWD_MAC_LEN,
+			   (unsigned char *)buf, len, out, &outlen ) == NULL )
+			rc = -1;
+	}
+#else
+	{
+		gcry_md_hd_t h = NULL;
+
+		if ( gcry_md_open( &h, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC ) ||
+		     gcry_md_setkey( h, pi->dedupe_key, SMBKRB5PWD_MAC_LEN ) ) {
+			rc = -1;
+		} else {
+			gcry_md_write( h, buf, len );
+			memcpy( out, gcry_md_read( h, GCRY_MD_SHA256 ),
+				SMBKRB5PWD_MAC_LEN );
+		}
+		gcry_md_close( h );
+	}
+#endif
+
+	smbkrb5pwd_wipe( buf, len );
+	return rc;
+}
+
+/* Throw away the remembered changes and, with olcSmbKrb5PwdDedupeTTL,
+ * start over with a new table of size entries and a new key */
+static int
+smbkrb5pwd_dedupe_reset( smbkrb5pwd_t *pi, int size )
+{
+	if ( pi->dedupe ) {
+		smbkrb5pwd_wipe( pi->dedupe,
+			pi->dedupe_size * sizeof( smbkrb5pwd_dedupe_ent ) );
+		ch_free( pi->dedupe );
+		pi->dedupe = NULL;
+	}
+	smbkrb5pwd_wipe( pi->dedupe_key, sizeof( pi->dedupe_key ) );
+	pi->dedupe_size = size;
+
+	if ( pi->dedupe_ttl == 0 )
+		return 0;
+
+#ifndef HAVE_GNUTLS
+	if ( RAND_bytes( pi->dedupe_key, sizeof( pi->dedupe_key ) ) != 1 ) {
+		Log0(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd : no random key for the dedupe cache\n");
+		return -1;
+	}
+#else
+	gcry_randomize( pi->dedupe_key, sizeof( pi->dedupe_key ),
+			GCRY_STRONG_RANDOM );
+#endif
+	pi->dedupe = ch_calloc( pi->dedupe_size,
+				sizeof( smbkrb5pwd_dedupe_ent ) );
+
+	return 0;
+}
+
+/* Is the change of kr to pw one that was applied within the TTL? */
+static int
+smbkrb5pwd_dedupe_find(
+	smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf,
+	smbkrb5pwd_krb5_req *kr,
+	struct berval *pw )
+{
+	unsigned char princ[ SMBKRB5PWD_MAC_LEN ];
+	unsigned char change[ SMBKRB5PWD_MAC_LEN ];
+	smbkrb5pwd_dedupe_ent *de;
+	uint32_t idx;
+	int hit;
+
+	/* the keys of an inline change only come from the helper */
+	if ( cf->dedupe_ttl == 0 || pi->dedupe == NULL || kr->kr_inline )
+		return 0;
+
+	if ( smbkrb5pwd_dedupe_mac( pi, kr->kr_princ, NULL, princ ) ||
+	     smbkrb5pwd_dedupe_mac( pi, kr->kr_princ, pw, change ) )
+		return 0;
+
+	memcpy( &idx, princ, sizeof( idx ) );
+	de = &pi->dedupe[ idx % pi->dedupe_size ];
+
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	hit = de->de_expires > slap_get_time() &&
+		!memcmp( de->de_princ, princ, sizeof( princ ) ) &&
+		!memcmp( de->de_change, change, sizeof( change ) );
+	if ( hit )
+		pi->dedupe_hits++;
+	else
+		pi->dedupe_misses++;
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+
+	return hit;
+}
+
+/* Remember the change of kr to pw if it succeeded; after a failure the
+ * state of the principal is unknown, so a retry must go to kerberos */
+static void
+smbkrb5pwd_dedupe_note(
+	smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf,
+	smbkrb5pwd_krb5_req *kr,
+	struct berval *pw,
+	int rc )
+{
+	unsigned char princ[ SMBKRB5PWD_MAC_LEN ];
+	unsigned char change[ SMBKRB5PWD_MAC_LEN ];
+	smbkrb5pwd_dedupe_ent *de;
+	uint32_t idx;
+
+	if ( cf->dedupe_ttl == 0 || pi->dedupe == NULL || kr->kr_inline )
+		return;
+
+	if ( smbkrb5pwd_dedupe_mac( pi, kr->kr_princ, NULL, princ ) ||
+	     smbkrb5pwd_dedupe_mac( pi, kr->kr_princ, pw, change ) )
+		return;
+
+	memcpy( &idx, princ, sizeof( idx ) );
+	de = &pi->dedupe[ idx % pi->dedupe_size ];
+
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	if ( rc == LDAP_SUCCESS ) {
+		memcpy( de->de_princ, princ, sizeof( princ ) );
+		memcpy( de->de_change, change, sizeof( change ) );
+		de->de_expires = slap_get_time() + cf->dedupe_ttl;
+	} else if ( !memcmp( de->de_princ, princ, sizeof( princ ) ) ) {
+		de->de_expires = 0;
+	}
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+}
+
+static int krb5_set_passwd(
+	Operation *op,
+	SlapReply *rs,
+	req_pwdexop_s *qpw,
+	Entry *e,
+	smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf)
+{
+	smbkrb5pwd_krb5_req kr;
+	smbkrb5pwd_slot *slot;
+	int rc;
+	struct timespec ts;
+
+	rc = smbkrb5pwd_krb5_prepare(op, pi, cf, e, &qpw->rs_new, &kr,
+				     &rs->sr_text);
+	if (rc != LDAP_SUCCESS)
+		return rc;
+
+	/* a retry of a change kerberos already has */
+	if (smbkrb5pwd_dedupe_find(pi, cf, &kr, &qpw->rs_new)) {
+		Log2(LDAP_DEBUG_TRACE, LDAP_LEVEL_INFO,
+		     "smbkrb5pwd %s : kerberos password of %s was just set,"
+		     " skipped\n", op->o_log_prefix, kr.kr_princ);
+		return LDAP_SUCCESS;
+	}
+
+	slot = smbkrb5pwd_slot_get(kr.kr_realm->rm_pool,
+				   SMBKRB5PWD_LANE_INTERACTIVE);
+	smbkrb5pwd_krb5_fill(op, &kr, &qpw->rs_new, slot);
+
+	SMBKRB5PWD_PROBE_OP(SMBKRB5PWD_PH_KRB5, op, kr.kr_princ);
+	smbkrb5pwd_trace_begin(&ts);
+	smbkrb5pwd_submit(kr.kr_realm->rm_pool, &slot, 1);
+	rc = smbkrb5pwd_wait(kr.kr_realm, slot);
+	smbkrb5pwd_trace(pi, op, SMBKRB5PWD_PH_KRB5, &ts, slot->sl_kadm5, rc);
+	smbkrb5pwd_shadow_mirror(op, pi, cf, &kr, &qpw->rs_new, slot, rc);
+	smbkrb5pwd_dedupe_note(pi, cf, &kr, &qpw->rs_new, rc);
+
+	if (rc != LDAP_SUCCESS) {
+		Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd %s : kerberos password change of %s"
+		     " failed: %s\n",
+		     op->o_log_prefix, slot->sl_princ, slot->sl_text);
+		rs->sr_text = smbkrb5pwd_slot_text(op, slot);
+	} else {
+		smbkrb5pwd_krb5_mods(&kr, slot, &qpw->rs_mods,
+				     &qpw->rs_modtail);
+	}
+
+	smbkrb5pwd_slot_put(kr.kr_realm->rm_pool, slot);
+
+	return rc;
+}
+
+/* Runqueue task started for every realm from smbkrb5pwd_realms_open().
+ * Resolves the admin principal (gethostname/getaddrinfo may block on
+ * DNS), starts the kerberos helpers of the realm and opens their kadm5
+ * sessions, so that neither config parsing nor slapd startup has to
+ * wait for them. Until this succeeds password changes in the realm are
+ * refused with LDAP_BUSY; on failure it is retried every
+ * SMBKRB5PWD_PREWARM_RETRY seconds. */
+static void *
+smbkrb5pwd_prewarm( void *ctx, void *arg )
+{
+	struct re_s	*rtask = arg;
+	smbkrb5pwd_realm *rm = rtask->arg;
+	int		rc;
+
+	smbkrb5pwd_set_state( rm, SMBKRB5PWD_S_WARMING );
+
+	rc = lookup_admin_princstr(rm->rm_name, &rm->rm_admin_princstr);
+	if ( rc == 0 ) {
+		Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_INFO,
+		     "smbkrb5pwd : using admin principal %s for realm %s\n",
+		     rm->rm_admin_princstr, rm->rm_name);
+		smbkrb5pwd_pool_stop( rm );
+		rc = smbkrb5pwd_pool_start( rm );
+		if ( rc == 0 ) {
+			rc = smbkrb5pwd_pool_init_sessions( rm );
+			if ( rc ) {
+				smbkrb5pwd_pool_stop( rm );
+			}
+		}
+	}
+
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( ldap_pvt_runqueue_isrunning( &slapd_rq, rtask ) )
+		ldap_pvt_runqueue_stoptask( &slapd_rq, rtask );
+	if ( rc == 0 ) {
+		ldap_pvt_runqueue_remove( &slapd_rq, rtask );
+		rm->rm_prewarm_task = NULL;
+	}
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+
+	if ( rc == 0 ) {
+		smbkrb5pwd_set_state( rm, SMBKRB5PWD_S_READY );
+		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
+		     "smbkrb5pwd : kerberos backend for realm %s is ready\n",
+		     rm->rm_name);
+	} else {
+		Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
+		     "smbkrb5pwd : prewarm of realm %s failed,"
+		     " retrying in %d seconds\n",
+		     rm->rm_name, SMBKRB5PWD_PREWARM_RETRY);
+	}
+
+	return NULL;
+}
+
+/* Stop the prewarm task and the helpers of a realm and free it */
+static void
+smbkrb5pwd_realm_free( smbkrb5pwd_realm *rm )
+{
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( rm->rm_prewarm_task ) {
+		struct re_s *re = rm->rm_prewarm_task;
+
+		rm->rm_prewarm_task = NULL;
+		if ( ldap_pvt_runqueue_isrunning( &slapd_rq, re ) )
+			ldap_pvt_runqueue_stoptask( &slapd_rq, re );
+		ldap_pvt_runqueue_remove( &slapd_rq, re );
+	}
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+
+	smbkrb5pwd_pool_stop( rm );
+	if ( rm->rm_admin_princstr )
+		free( rm->rm_admin_princstr );
+	ch_free( rm->rm_admin_server );
+	ch_free( rm->rm_name );
+	ch_free( rm );
+}
+
+/* Runqueue task replaying the shadow queue in the shadow realm, every
+ * SMBKRB5PWD_SHADOW_INTERVAL seconds. The changes are handed to the
+ * helpers in chunks like a batch, in the interactive lane of the shadow
+ * pool, which serves nothing else. */
+static void *
+smbkrb5pwd_shadow( void *ctx, void *arg )
+{
+	struct re_s	*rtask = arg;
+	smbkrb5pwd_t	*pi = rtask->arg;
+	smbkrb5pwd_realm *rm = pi->shadow_realm;
+	smbkrb5pwd_shadow_ent *chunk[ SMBKRB5PWD_SHADOW_CHUNK ];
+	smbkrb5pwd_slot	*slots[ SMBKRB5PWD_SHADOW_CHUNK ];
+	int		i, k, rc;
+
+	/* the queue stays while the shadow is warming; it drops when full */
+	while ( !slapd_shutdown && rm->rm_pool &&
+		smbkrb5pwd_get_state( rm ) == SMBKRB5PWD_S_READY ) {
+		ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+		for ( k = 0; k < SMBKRB5PWD_SHADOW_CHUNK && pi->shadow_queue; k++ ) {
+			chunk[k] = pi->shadow_queue;
+			pi->shadow_queue = chunk[k]->se_next;
+			pi->shadow_nqueue--;
+		}
+		if ( pi->shadow_queue == NULL )
+			pi->shadow_tail = &pi->shadow_queue;
+		ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+		if ( k == 0 )
+			break;
+
+		smbkrb5pwd_slot_get_n( rm->rm_pool, SMBKRB5PWD_LANE_INTERACTIVE,
+				       slots, k );
+		for ( i = 0; i < k; i++ ) {
+			memcpy( slots[i]->sl_princ, chunk[i]->se_princ,
+				sizeof( slots[i]->sl_princ ) );
+			memcpy( slots[i]->sl_password, chunk[i]->se_pw.bv_val,
+				chunk[i]->se_pw.bv_len + 1 );
+			slots[i]->sl_req = SMBKRB5PWD_REQ_SETPW;
+			slots[i]->sl_connid = chunk[i]->se_connid;
+			slots[i]->sl_opid = chunk[i]->se_opid;
+		}
+		smbkrb5pwd_submit( rm->rm_pool, slots, k );
+
+		for ( i = 0; i < k; i++ ) {
+			rc = smbkrb5pwd_wait( rm, slots[i] );
+			smbkrb5pwd_shadow_stat( pi, SMBKRB5PWD_SHADOW_SECONDARY,
+						slots[i], rc );
+			if ( rc != LDAP_SUCCESS ) {
+				Log3(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO,
+				     "smbkrb5pwd conn=%lu : shadow change of %s"
+				     " failed: %s\n", chunk[i]->se_connid,
+				     slots[i]->sl_princ, slots[i]->sl_text);
+			}
+			smbkrb5pwd_slot_put( rm->rm_pool, slots[i] );
+			smbkrb5pwd_shadow_ent_free( chunk[i] );
+		}
+	}
+
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( ldap_pvt_runqueue_isrunning( &slapd_rq, rtask ) )
+		ldap_pvt_runqueue_stoptask( &slapd_rq, rtask );
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+
+	return NULL;
+}
+
+/* Start mirroring to olcSmbKrb5PwdShadowRealm; same calling context as
+ * smbkrb5pwd_realms_open() */
+static void
+smbkrb5pwd_shadow_open( smbkrb5pwd_t *pi )
+{
+	smbkrb5pwd_realm *rm;
+
+	if ( pi->be == NULL || pi->shadow_name == NULL ||
+	     pi->shadow_realm != NULL || !SMBKRB5PWD_DO_KRB5( pi ) ||
+	     pi->nrealms == 0 ) {
+		return;
+	}
+
+	rm = ch_calloc( 1, sizeof( smbkrb5pwd_realm ) );
+	rm->rm_pi = pi;
+	rm->rm_name = ch_strdup( pi->shadow_name );
+	if ( pi->shadow_server )
+		rm->rm_admin_server = ch_strdup( pi->shadow_server );
+	rm->rm_state = SMBKRB5PWD_S_COLD;
+	pi->shadow_realm = rm;
+
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	rm->rm_prewarm_task = ldap_pvt_runqueue_insert( &slapd_rq,
+		SMBKRB5PWD_PREWARM_RETRY, smbkrb5pwd_prewarm, rm,
+		"smbkrb5pwd_prewarm", rm->rm_name );
+	pi->shadow_task = ldap_pvt_runqueue_insert( &slapd_rq,
+		SMBKRB5PWD_SHADOW_INTERVAL, smbkrb5pwd_shadow, pi,
+		"smbkrb5pwd_shadow", rm->rm_name );
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+}
+
+/* Stop mirroring and drop the queue; the statistics stay */
+static void
+smbkrb5pwd_shadow_close( smbkrb5pwd_t *pi )
+{
+	smbkrb5pwd_shadow_ent *se;
+
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( pi->shadow_task ) {
+		struct re_s *re = pi->shadow_task;
+
+		pi->shadow_task = NULL;
+		if ( ldap_pvt_runqueue_isrunning( &slapd_rq, re ) )
+			ldap_pvt_runqueue_stoptask( &slapd_rq, re );
+		ldap_pvt_runqueue_remove( &slapd_rq, re );
+	}
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+
+	if ( pi->shadow_realm ) {
+		smbkrb5pwd_realm_free( pi->shadow_realm );
+		pi->shadow_realm = NULL;
+	}
+
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	while ( ( se = pi->shadow_queue ) != NULL ) {
+		pi->shadow_queue = se->se_next;
+		smbkrb5pwd_shadow_ent_free( se );
+	}
+	pi->shadow_tail = &pi->shadow_queue;
+	pi->shadow_nqueue = 0;
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+}
+
+/* Build the realms and routes from the configuration and start the
+ * prewarm phase of every realm. The caller is either db_open or
+ * back-config with the thread pool paused. */
+static void
+smbkrb5pwd_realms_open( smbkrb5pwd_t *pi )
+{
+	smbkrb5pwd_realm *rm;
+	struct berval name;
+	int i, j;
+
+	for ( i = -1; i < pi->nrealm_maps; i++ ) {
+		if ( i == -1 ) {
+			if ( pi->kerberos_realm == NULL )
+				continue;
+			ber_str2bv( pi->kerberos_realm, 0, 0, &name );
+		} else {
+			name = pi->realm_maps[i].mp_realm;
+		}
+
+		/* realms are few, the sorted table is built below */
+		rm = NULL;
+		for ( j = 0; j < pi->nrealms; j++ ) {
+			if ( !strcmp( pi->realms[j]->rm_name, name.bv_val ) ) {
+				rm = pi->realms[j];
+				break;
+			}
+		}
+
+		if ( rm == NULL ) {
+			rm = ch_calloc( 1, sizeof( smbkrb5pwd_realm ) );
+			rm->rm_pi = pi;
+			rm->rm_name = ch_strdup( name.bv_val );
+			rm->rm_state = SMBKRB5PWD_S_COLD;
+			pi->realms = ch_realloc( pi->realms,
+				( pi->nrealms + 1 ) * sizeof( smbkrb5pwd_realm * ) );
+			pi->realms[pi->nrealms++] = rm;
+		}
+
+		if ( i == -1 ) {
+			pi->default_realm = rm;
+		} else if ( !BER_BVISEMPTY( &pi->realm_maps[i].mp_nbase ) ) {
+			pi->routes = ch_realloc( pi->routes,
+				( pi->nroutes + 1 ) * sizeof( smbkrb5pwd_route ) );
+			pi->routes[pi->nroutes].rt_ndn = pi->realm_maps[i].mp_nbase;
+			pi->routes[pi->nroutes].rt_realm = rm;
+			pi->nroutes++;
+		}
+	}
+
+	if ( pi->nrealms )
+		qsort( pi->realms, pi->nrealms, sizeof( smbkrb5pwd_realm * ),
+		       smbkrb5pwd_realm_cmp );
+	if ( pi->nroutes )
+		qsort( pi->routes, pi->nroutes, sizeof( smbkrb5pwd_route ),
+		       smbkrb5pwd_route_cmp );
+
+	if ( !SMBKRB5PWD_DO_KRB5( pi ) ) {
+		return;
+	}
+
+	if ( pi->nrealms == 0 ) {
+		Log0(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+		     "smbkrb5pwd : no kerberos realm configured"
+		     " (olcSmbKrb5PwdKrb5Realm)\n");
+		return;
+	}
+
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	for ( i = 0; i < pi->nrealms; i++ ) {
+		rm = pi->realms[i];
+		rm->rm_prewarm_task = ldap_pvt_runqueue_insert( &slapd_rq,
+			SMBKRB5PWD_PREWARM_RETRY, smbkrb5pwd_prewarm, rm,
+			"smbkrb5pwd_prewarm", rm->rm_name );
+	}
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+
+	smbkrb5pwd_shadow_open( pi );
+}
+
+/* Stop the helpers of all realms and free them; same calling context
+ * as smbkrb5pwd_realms_open(), or db_close */
+static void
+smbkrb5pwd_realms_close( smbkrb5pwd_t *pi )
+{
+	int i;
+
+	smbkrb5pwd_shadow_close( pi );
+
+	for ( i = 0; i < pi->nrealms; i++ ) {
+		smbkrb5pwd_realm_free( pi->realms[i] );
+	}
+
+	ch_free( pi->realms );
+	pi->realms = NULL;
+	pi->nrealms = 0;
+	/* rt_ndn belongs to realm_maps */
+	ch_free( pi->routes );
+	pi->routes = NULL;
+	pi->nroutes = 0;
+	pi->default_realm = NULL;
+}
+
+/* Apply a change of the realm configuration at runtime */
+static void
+smbkrb5pwd_realms_reopen( smbkrb5pwd_t *pi )
+{
+	if ( pi->be == NULL ) {
+		return;
+	}
+
+	smbkrb5pwd_realms_close( pi );
+	smbkrb5pwd_realms_open( pi );
+}
+
+/* Apply a changed olcSmbKrb5PwdHelpers to the running pools; called
+ * from back-config with the thread pool paused */
+static void
+smbkrb5pwd_realms_resize( smbkrb5pwd_t *pi )
+{
+	int i;
+
+	for ( i = 0; i < pi->nrealms; i++ ) {
+		smbkrb5pwd_pool_resize( pi->realms[i], pi->helpers );
+	}
+	if ( pi->shadow_realm )
+		smbkrb5pwd_pool_resize( pi->shadow_realm, pi->helpers );
+}
+
+/* Apply changed lane caps to the running helpers; called from
+ * back-config with the thread pool paused */
+static void
+smbkrb5pwd_realms_caps( smbkrb5pwd_t *pi )
+{
+	int i;
+
+	for ( i = 0; i < pi->nrealms; i++ ) {
+		if ( pi->realms[i]->rm_pool )
+			smbkrb5pwd_pool_caps( pi, pi->realms[i]->rm_pool );
+	}
+	if ( pi->shadow_realm && pi->shadow_realm->rm_pool )
+		smbkrb5pwd_pool_caps( pi, pi->shadow_realm->rm_pool );
+}
+
+/* An entry whose samba expiry times do not match the intervals */
+typedef struct smbkrb5pwd_restamp_ent {
+	struct berval	rp_ndn;
+	time_t		rp_lastset;
+} smbkrb5pwd_restamp_ent;
+
+static struct berval smbkrb5pwd_restamp_filter =
+	BER_BVC("(&(objectClass=sambaSamAccount)(sambaPwdLastSet=*))");
+
+static void
+smbkrb5pwd_restamp_progress( smbkrb5pwd_t *pi, int state,
+	unsigned long done, unsigned long failed )
+{
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	pi->restamp_state = state;
+	pi->restamp_total = pi->restamp_num;
+	pi->restamp_done = done;
+	pi->restamp_failed = failed;
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+}
+
+static void
+smbkrb5pwd_restamp_free( smbkrb5pwd_t *pi )
+{
+	int i;
+
+	for ( i = 0; i < pi->restamp_num; i++ )
+		ch_free( pi->restamp_ents[i].rp_ndn.bv_val );
+	ch_free( pi->restamp_ents );
+	pi->restamp_ents = NULL;
+	pi->restamp_num = 0;
+	pi->restamp_next = 0;
+}
+
+/* Does ad of e hold something else than the time t? */
+static int
+smbkrb5pwd_time_differs( Entry *e, AttributeDescription *ad, time_t t )
+{
+	Attribute *a;
+	char buf[ LDAP_PVT_INTTYPE_CHARS(long) ];
+	struct berval bv;
+
+	a = attr_find( e->e_attrs, ad );
+	if ( a == NULL || a->a_numvals != 1 )
+		return 1;
+
+	bv.bv_val = buf;
+	bv.bv_len = snprintf( buf, sizeof(buf), "%ld", (long)t );
+
+	return !bvmatch( &a->a_vals[0], &bv );
+}
+
+/* Collect the DNs of the entries that need to be re-stamped; the
+ * modifications are done later in batches, outside of the search. */
+static int
+smbkrb5pwd_restamp_cb( Operation *op, SlapReply *rs )
+{
+	smbkrb5pwd_t *pi = op->o_callback->sc_private;
+	smbkrb5pwd_conf *cf = smbkrb5pwd_conf_get( pi );
+	Entry *e = rs->sr_entry;
+	Attribute *a;
+	long lastset;
+
+	if ( rs->sr_type != REP_SEARCH )
+		return 0;
+
+	if ( cf->oc_requiredObjectclass &&
+	     !is_entry_objectclass( e, cf->oc_requiredObjectclass, 0 ) )
+		return 0;
+
+	a = attr_find( e->e_attrs, ad_sambaPwdLastSet );
+	if ( a == NULL || lutil_atol( &lastset, a->a_vals[0].bv_val ) != 0 )
+		return 0;
+
+	if ( !( pi->restamp_must && smbkrb5pwd_time_differs( e,
+			ad_sambaPwdMustChange, lastset + pi->restamp_must ) ) &&
+	     !( pi->restamp_can && smbkrb5pwd_time_differs( e,
+			ad_sambaPwdCanChange, lastset + pi->restamp_can ) ) )
+		return 0;
+
+	if ( ( pi->restamp_num & 1023 ) == 0 ) {
+		pi->restamp_ents = ch_realloc( pi->restamp_ents,
+			( pi->restamp_num + 1024 ) *
+			sizeof( smbkrb5pwd_restamp_ent ) );
+	}
+	ber_dupbv( &pi->restamp_ents[pi->restamp_num].rp_ndn, &e->e_nname );
+	pi->restamp_ents[pi->restamp_num].rp_lastset = lastset;
+	pi->restamp_num++;
+
+	return 0;
+}
+
+/* Runqueue task re-stamping sambaPwdMustChange and sambaPwdCanChange
+ * from sambaPwdLastSet and the configured intervals, the way
+ * smbkrb5pwd_exop_passwd() would have stamped them.
+ *
+ * The first run searches the database for entries whose values do not
+ * match. Every run then modifies at most olcSmbKrb5PwdRestampBatch of
+ * them and gives the thread back; the runqueue starts the next batch
+ * olcSmbKrb5PwdRestampInterval seconds later. Already re-stamped entries
+ * are not found again, so a run interrupted by a restart or by another
+ * change of the intervals resumes where it was when it is restarted. */
+static void *
+smbkrb5pwd_restamp( void *ctx, void *arg )
+{
+	struct re_s	*rtask = arg;
+	smbkrb5pwd_t	*pi = rtask->arg;
+	Connection	conn = { 0 };
+	OperationBuffer	opbuf;
+	Operation	*op;
+	SlapReply	rs = { REP_RESULT };
+	slap_callback	cb = { NULL, smbkrb5pwd_restamp_cb, NULL, NULL };
+	slap_callback	nullsc = { NULL, slap_null_cb, NULL, NULL };
+	unsigned long	done, failed;
+	int		i, end, finished = 0;
+
+	connection_fake_init( &conn, &opbuf, ctx );
+	op = &opbuf.ob_op;
+	op->o_bd = pi->be;
+	op->o_dn = op->o_bd->be_rootdn;
+	op->o_ndn = op->o_bd->be_rootndn;
+
+	if ( pi->restamp_ents == NULL || pi->restamp_scanned != pi->restamp_gen ) {
+		smbkrb5pwd_conf *cf = smbkrb5pwd_conf_get( pi );
+
+		smbkrb5pwd_restamp_free( pi );
+		pi->restamp_scanned = pi->restamp_gen;
+		pi->restamp_must = cf->smb_must_change;
+		pi->restamp_can = cf->smb_can_change;
+		smbkrb5pwd_restamp_progress( pi, SMBKRB5PWD_R_SCANNING, 0, 0 );
+
+		if ( pi->restamp_must || pi->restamp_can ) {
+			op->o_tag = LDAP_REQ_SEARCH;
+			op->o_req_dn = op->o_bd->be_suffix[0];
+			op->o_req_ndn = op->o_bd->be_nsuffix[0];
+			op->o_callback = &cb;
+			cb.sc_private = pi;
+			op->ors_scope = LDAP_SCOPE_SUBTREE;
+			op->ors_deref = LDAP_DEREF_NEVER;
+			op->ors_tlimit = SLAP_NO_LIMIT;
+			op->ors_slimit = SLAP_NO_LIMIT;
+			op->ors_filterstr = smbkrb5pwd_restamp_filter;
+			op->ors_filter = str2filter_x( op,
+				smbkrb5pwd_restamp_filter.bv_val );
+			op->ors_attrs = slap_anlist_no_attrs;
+			op->ors_attrsonly = 1;
+
+			op->o_bd->be_search( op, &rs );
+			filter_free_x( op, op->ors_filter, 1 );
+		}
+
+		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
+		     "smbkrb5pwd : %d entries to re-stamp\n",
+		     pi->restamp_num);
+	}
+
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	done = pi->restamp_done;
+	failed = pi->restamp_failed;
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+	smbkrb5pwd_restamp_progress( pi, SMBKRB5PWD_R_WRITING, done, failed );
+
+	op->o_tag = LDAP_REQ_MODIFY;
+	op->o_callback = &nullsc;
+	op->orm_no_opattrs = 0;
+
+	end = pi->restamp_next + pi->restamp_batch;
+	if ( end > pi->restamp_num )
+		end = pi->restamp_num;
+
+	for ( i = pi->restamp_next; i < end && !slapd_shutdown; i++ ) {
+		smbkrb5pwd_restamp_ent *ent = &pi->restamp_ents[i];
+		Modifications *ml = NULL;
+
+		if ( pi->restamp_must )
+			ml = smbkrb5pwd_time_mod( ad_sambaPwdMustChange,
+				ent->rp_lastset + pi->restamp_must, ml );
+		if ( pi->restamp_can )
+			ml = smbkrb5pwd_time_mod( ad_sambaPwdCanChange,
+				ent->rp_lastset + pi->restamp_can, ml );
+
+		/* only if the password was not changed since the scan,
+		 * which stamped the entry already: delete and add back
+		 * the sambaPwdLastSet the times were computed from */
+		ml = smbkrb5pwd_time_mod( ad_sambaPwdLastSet,
+			ent->rp_lastset, ml );
+		ml->sml_op = LDAP_MOD_ADD;
+		ml = smbkrb5pwd_time_mod( ad_sambaPwdLastSet,
+			ent->rp_lastset, ml );
+		ml->sml_op = LDAP_MOD_DELETE;
+
+		op->o_req_dn = ent->rp_ndn;
+		op->o_req_ndn = ent->rp_ndn;
+		op->orm_modlist = ml;
+		rs_reinit( &rs, REP_RESULT );
+		op->o_bd->be_modify( op, &rs );
+		slap_mods_free( ml, 1 );
+
+		if ( rs.sr_err == LDAP_SUCCESS || rs.sr_err == LDAP_NO_SUCH_OBJECT ||
+		     rs.sr_err == LDAP_NO_SUCH_ATTRIBUTE ) {
+			done++;
+		} else {
+			Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+			     "smbkrb5pwd : re-stamping %s failed (%d)\n",
+			     ent->rp_ndn.bv_val, rs.sr_err);
+			failed++;
+		}
+	}
+	pi->restamp_next = i;
+
+	if ( pi->restamp_next == pi->restamp_num ) {
+		finished = 1;
+		smbkrb5pwd_restamp_progress( pi, SMBKRB5PWD_R_DONE, done, failed );
+		Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
+		     "smbkrb5pwd : re-stamping done, %lu entries modified,"
+		     " %lu failed\n", done, failed);
+		smbkrb5pwd_restamp_free( pi );
+	} else {
+		smbkrb5pwd_restamp_progress( pi, SMBKRB5PWD_R_WRITING, done, failed );
+		Log3(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO,
+		     "smbkrb5pwd : re-stamp checkpoint %lu/%d, %lu failed\n",
+		     done + failed, pi->restamp_num, failed);
+	}
+
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( ldap_pvt_runqueue_isrunning( &slapd_rq, rtask ) )
+		ldap_pvt_runqueue_stoptask( &slapd_rq, rtask );
+	if ( finished ) {
+		ldap_pvt_runqueue_remove( &slapd_rq, rtask );
+		pi->restamp_task = NULL;
+	}
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+
+	return NULL;
+}
+
+/* Start re-stamping with the current intervals. Called from db_open or
+ * from back-config with the thread pool paused, so the task is not
+ * running; a pending run rescans before its next batch. */
+static void
+smbkrb5pwd_restamp_schedule( smbkrb5pwd_t *pi )
+{
+	pi->restamp_gen++;
+
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( pi->restamp_task == NULL ) {
+		pi->restamp_task = ldap_pvt_runqueue_insert( &slapd_rq,
+			pi->restamp_interval, smbkrb5pwd_restamp, pi,
+			"smbkrb5pwd_restamp", pi->be->be_suffix[0].bv_val );
+	}
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+}
+
+/* Stop re-stamping; same calling context as smbkrb5pwd_restamp_schedule() */
+static void
+smbkrb5pwd_restamp_cancel( smbkrb5pwd_t *pi )
+{
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( pi->restamp_task ) {
+		struct re_s *re = pi->restamp_task;
+
+		pi->restamp_task = NULL;
+		if ( ldap_pvt_runqueue_isrunning( &slapd_rq, re ) )
+			ldap_pvt_runqueue_stoptask( &slapd_rq, re );
+		ldap_pvt_runqueue_remove( &slapd_rq, re );
+	}
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+
+	smbkrb5pwd_restamp_free( pi );
+	smbkrb5pwd_restamp_progress( pi, SMBKRB5PWD_R_IDLE, 0, 0 );
+}
+
+/* If userPassword of e holds a SASL identity, prepend a replace that
+ * restores it. Returns 1 if it did. */
+static int
+smbkrb5pwd_keep_sasl(
+	Entry *e,
+	Modifications **mods,
+	Modifications ***modtail )
+{
+	Attribute *a;
+	Modifications *ml;
+	struct berval *keys;
+
+	a = attr_find( e->e_attrs, ad_userPassword );
+	if (a) {
+		const char* SASL_SCHEME = "{sasl}";
+		const int SASL_SCHEME_LEN = 6;
+		if (a->a_vals[0].bv_len >= SASL_SCHEME_LEN && strncasecmp(a->a_vals[0].bv_val, SASL_SCHEME, SASL_SCHEME_LEN) == 0) {
+
+			ml = ch_malloc(sizeof(Modifications));
+			if (!*modtail) *modtail = &ml->sml_next;
+			ml->sml_next = *mods;
+			*mods = ml;
+
+			keys = ch_malloc( 2 * sizeof(struct berval) );
+			BER_BVZERO( &keys[1] );
+			ber_dupbv(keys, &a->a_vals[0]);
+
+			ml->sml_desc = ad_userPassword;
+			ml->sml_op = LDAP_MOD_REPLACE;
+#ifdef SLAP_MOD_INTERNAL
+			ml->sml_flags = SLAP_MOD_INTERNAL;
+#endif
+			ml->sml_numvals = 1;
+			ml->sml_values = keys;
+			ml->sml_nvalues = NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Prepend sambaNTPassword and, if stamp is set, the samba timestamps
+ * for the password pw, which must be NUL terminated; op is only used
+ * for tracing */
+static void
+smbkrb5pwd_samba_mods(
+	Operation *op,
+	smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf,
+	struct berval *pw,
+	int stamp,
+	Modifications **mods,
+	Modifications ***modtail )
+{
+	Modifications *ml;
+	struct berval *keys;
+	ber_len_t j,l;
+	wchar_t *wcs, wc;
+	char *c;
+	struct berval pwd;
+	time_t now;
+	struct timespec ts;
+
+	/* Expand incoming UTF8 string to UCS4 */
+	l = ldap_utf8_chars(pw->bv_val);
+	wcs = ch_malloc((l+1) * sizeof(wchar_t));
+
+	ldap_x_utf8s_to_wcs( wcs, pw->bv_val, l );
+	
+	/* Truncate UCS4 to UCS2 */
+	c = (char *)wcs;
+	for (j=0; j<l; j++) {
+		wc = wcs[j];
+		*c++ = wc & 0xff;
+		*c++ = (wc >> 8) & 0xff;
+	}
+	*c++ = 0;
+	pwd.bv_val = (char *)wcs;
+	pwd.bv_len = l * 2;
+
+	ml = ch_malloc(sizeof(Modifications));
+	if (!*modtail) *modtail = &ml->sml_next;
+	ml->sml_next = *mods;
+	*mods = ml;
+
+	keys = ch_malloc( 2 * sizeof(struct berval) );
+	BER_BVZERO( &keys[1] );
+	SMBKRB5PWD_PROBE_OP( SMBKRB5PWD_PH_NTHASH, op, "" );
+	smbkrb5pwd_trace_begin( &ts );
+	nthash( &pwd, keys );
+	smbkrb5pwd_trace( pi, op, SMBKRB5PWD_PH_NTHASH, &ts, 0, LDAP_SUCCESS );
+	
+	ml->sml_desc = ad_sambaNTPassword;
+	ml->sml_op = LDAP_MOD_REPLACE;
+#ifdef SLAP_MOD_INTERNAL
+	ml->sml_flags = SLAP_MOD_INTERNAL;
+#endif
+	ml->sml_numvals = 1;
+	ml->sml_values = keys;
+	ml->sml_nvalues = NULL;
+
+	ch_free(wcs);
+
+	if (!stamp)
+		return;
+
+	/* one timestamp, so that the expiry times are exactly
+	 * sambaPwdLastSet plus the intervals (see smbkrb5pwd_restamp) */
+	now = slap_get_time();
+	*mods = smbkrb5pwd_time_mod( ad_sambaPwdLastSet, now, *mods );
+
+	if (cf->smb_must_change)
+		*mods = smbkrb5pwd_time_mod( ad_sambaPwdMustChange,
+			now + cf->smb_must_change, *mods );
+
+	if (cf->smb_can_change)
+		*mods = smbkrb5pwd_time_mod( ad_sambaPwdCanChange,
+			now + cf->smb_can_change, *mods );
+}
+
+/*
+ * Credential upgrade on bind
+ *
+ * Entries whose passwords were set before olcSmbKrb5PwdCredGeneration
+ * was raised, or before samba was enabled, still hold the old kerberos
+ * keys and lack sambaNTPassword. The clear text password is only seen
+ * again when the user binds, so a successful simple bind queues the
+ * entry and smbkrb5pwd_upgrade() sets the missing credentials from the
+ * bind password in the background; the bind itself never waits for
+ * kerberos. Every change writes the generation to the entry, in
+ * smbkrb5pwdCredVersion, so that each entry is upgraded only once.
+ *
+ * At most olcSmbKrb5PwdUpgradeRate entries per hour are queued, evenly
+ * spaced, so that a morning of logins does not turn into a burst of
+ * kadm5 changes. Binds that find the queue full or the rate used up
+ * are skipped; the entry is queued by a later bind.
+ */
+typedef struct smbkrb5pwd_upgrade_ent {
+	struct smbkrb5pwd_upgrade_ent	*ue_next;
+	struct berval			ue_ndn;
+	struct berval			ue_pw;	/* NUL terminated copy */
+} smbkrb5pwd_upgrade_ent;
+
+static void
+smbkrb5pwd_upgrade_ent_free( smbkrb5pwd_upgrade_ent *ue )
+{
+	smbkrb5pwd_wipe( ue->ue_pw.bv_val, ue->ue_pw.bv_len );
+	ch_free( ue->ue_pw.bv_val );
+	ch_free( ue->ue_ndn.bv_val );
+	ch_free( ue );
+}
+
+/* Whether the credentials of e are older than the configuration */
+static int
+smbkrb5pwd_upgrade_needed( smbkrb5pwd_conf *cf, Entry *e )
+{
+	if ( cf->oc_requiredObjectclass &&
+	     !is_entry_objectclass( e, cf->oc_requiredObjectclass, 0 ) )
+		return 0;
+
+	if ( smbkrb5pwd_attr_long( e, ad_smbkrb5pwdCredVersion )
+	     < cf->cred_generation )
+		return 1;
+
+	if ( SMBKRB5PWD_DO_SAMBA( cf ) &&
+	     is_entry_objectclass( e, oc_sambaSamAccount, 0 ) &&
+	     attr_find( e->e_attrs, ad_sambaNTPassword ) == NULL )
+		return 1;
+
+	return 0;
+}
+
+/* Queue ndn for an upgrade with the password pw, unless the queue is
+ * full, ndn is already queued or the rate is used up */
+static void
+smbkrb5pwd_upgrade_queue( smbkrb5pwd_t *pi, smbkrb5pwd_conf *cf,
+	struct berval *ndn, struct berval *pw )
+{
+	smbkrb5pwd_upgrade_ent *ue = NULL;
+	struct timespec ts;
+	unsigned long long now;
+	int queue = 0;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	now = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	if ( pi->upgrade_nqueue < SMBKRB5PWD_UPGRADE_QUEUE &&
+	     pi->upgrade_next <= now ) {
+		queue = 1;
+		for ( ue = pi->upgrade_queue; ue; ue = ue->ue_next ) {
+			if ( dn_match( &ue->ue_ndn, ndn ) ) {
+				queue = 0;
+				break;
+			}
+		}
+	}
+	if ( queue ) {
+		ue = ch_calloc( 1, sizeof( smbkrb5pwd_upgrade_ent ) );
+		ber_dupbv( &ue->ue_ndn, ndn );
+		ber_dupbv( &ue->ue_pw, pw );
+		*pi->upgrade_tail = ue;
+		pi->upgrade_tail = &ue->ue_next;
+		pi->upgrade_nqueue++;
+		pi->upgrade_queued++;
+		pi->upgrade_next = now + 3600000ULL / cf->upgrade_rate;
+	} else {
+		pi->upgrade_skipped++;
+	}
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+}
+
+typedef struct smbkrb5pwd_bind_cb {
+	slap_callback	bc_cb;
+	slap_overinst	*bc_on;
+} smbkrb5pwd_bind_cb;
+
+static int
+smbkrb5pwd_bind_response( Operation *op, SlapReply *rs )
+{
+	smbkrb5pwd_bind_cb *bc = op->o_callback->sc_private;
+	smbkrb5pwd_t *pi = bc->bc_on->on_bi.bi_private;
+	smbkrb5pwd_conf *cf = smbkrb5pwd_conf_get( pi );
+	BackendInfo *bi = op->o_bd->bd_info;
+	Entry *e;
+	int needed;
+
+	if ( rs->sr_type != REP_RESULT || rs->sr_err != LDAP_SUCCESS )
+		return SLAP_CB_CONTINUE;
+
+	op->o_bd->bd_info = (BackendInfo *)bc->bc_on->on_info;
+	if ( be_entry_get_rw( op, &op->o_req_ndn, NULL, NULL, 0, &e )
+	     == LDAP_SUCCESS ) {
+		needed = smbkrb5pwd_upgrade_needed( cf, e );
+		be_entry_release_r( op, e );
+		if ( needed )
+			smbkrb5pwd_upgrade_queue( pi, cf, &op->o_req_ndn,
+						  &op->orb_cred );
+	}
+	op->o_bd->bd_info = bi;
+
+	return SLAP_CB_CONTINUE;
+}
+
+static int
+smbkrb5pwd_bind( Operation *op, SlapReply *rs )
+{
+	slap_overinst *on = (slap_overinst *)op->o_bd->bd_info;
+	smbkrb5pwd_t *pi = on->on_bi.bi_private;
+	smbkrb5pwd_bind_cb *bc;
+
+	if ( pi->upgrade_task == NULL || op->orb_method != LDAP_AUTH_SIMPLE ||
+	     BER_BVISEMPTY( &op->orb_cred ) ||
+	     op->orb_cred.bv_len >= SMBKRB5PWD_PW_MAX ||
+	     be_isroot_dn( op->o_bd, &op->o_req_ndn ) )
+		return SLAP_CB_CONTINUE;
+
+	bc = op->o_tmpcalloc( 1, sizeof( smbkrb5pwd_bind_cb ),
+			      op->o_tmpmemctx );
+	bc->bc_cb.sc_response = smbkrb5pwd_bind_response;
+	bc->bc_cb.sc_private = bc;
+	bc->bc_on = on;
+	overlay_callback_after_backover( op, &bc->bc_cb, 1 );
+
+	return SLAP_CB_CONTINUE;
+}
+
+/* Upgrade the credentials of a queued entry */
+static int
+smbkrb5pwd_upgrade_one( Operation *op, smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf, smbkrb5pwd_upgrade_ent *ue )
+{
+	smbkrb5pwd_krb5_req kr;
+	smbkrb5pwd_slot *slot;
+	Modifications *mods = NULL, **modtail = NULL;
+	SlapReply rs = { REP_RESULT };
+	slap_callback nullsc = { NULL, slap_null_cb, NULL, NULL };
+	const char *text = NULL;
+	Attribute *a;
+	Entry *e;
+	int rc, sasl = 0;
+
+	rc = be_entry_get_rw( op, &ue->ue_ndn, NULL, NULL, 0, &e );
+	if ( rc != LDAP_SUCCESS )
+		return rc;
+
+	/* upgraded or changed since the bind */
+	if ( !smbkrb5pwd_upgrade_needed( cf, e ) ) {
+		be_entry_release_r( op, e );
+		return LDAP_SUCCESS;
+	}
+
+	/* The password may have been changed by a plain modify since the
+	 * bind; only a password that still matches may be written. With
+	 * {SASL} the bind was checked by kerberos itself, which cannot be
+	 * asked again here, so only the samba password is set then. */
+	a = attr_find( e->e_attrs, ad_userPassword );
+	if ( a && a->a_vals[0].bv_len >= STRLENOF( "{sasl}" ) &&
+	     strncasecmp( a->a_vals[0].bv_val, "{sasl}",
+			  STRLENOF( "{sasl}" ) ) == 0 ) {
+		sasl = 1;
+	} else if ( a == NULL ||
+		    slap_passwd_check( op, e, a, &ue->ue_pw, &text ) != 0 ) {
+		be_entry_release_r( op, e );
+		return LDAP_SUCCESS;
+	}
+
+	if ( SMBKRB5PWD_DO_KRB5( cf ) && !sasl ) {
+		rc = smbkrb5pwd_krb5_prepare( op, pi, cf, e, &ue->ue_pw, &kr,
+					      &text );
+		if ( rc != LDAP_SUCCESS ) {
+			be_entry_release_r( op, e );
+			return rc;
+		}
+
+		slot = smbkrb5pwd_slot_get( kr.kr_realm->rm_pool,
+					    SMBKRB5PWD_LANE_BACKGROUND );
+		smbkrb5pwd_krb5_fill( op, &kr, &ue->ue_pw, slot );
+		smbkrb5pwd_submit( kr.kr_realm->rm_pool, &slot, 1 );
+		rc = smbkrb5pwd_wait( kr.kr_realm, slot );
+
+		smbkrb5pwd_dedupe_note( pi, cf, &kr, &ue->ue_pw, rc );
+
+		/* the history already holds it, so kerberos is current */
+		if ( rc != LDAP_SUCCESS &&
+		     slot->sl_kadm5 == KADM5_PASS_REUSE )
+			rc = LDAP_SUCCESS;
+		else if ( rc == LDAP_SUCCESS )
+			smbkrb5pwd_krb5_mods( &kr, slot, &mods, &modtail );
+		else
+			Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+			     "smbkrb5pwd : kerberos upgrade of %s failed: %s\n",
+			     slot->sl_princ, slot->sl_text);
+
+		smbkrb5pwd_slot_put( kr.kr_realm->rm_pool, slot );
+		if ( rc != LDAP_SUCCESS ) {
+			be_entry_release_r( op, e );
+			slap_mods_free( mods, 1 );
+			return rc;
+		}
+	}
+
+	/* the samba expiry times stay, the password did not change */
+	if ( SMBKRB5PWD_DO_SAMBA( cf ) &&
+	     is_entry_objectclass( e, oc_sambaSamAccount, 0 ) )
+		smbkrb5pwd_samba_mods( op, pi, cf, &ue->ue_pw, 0, &mods,
+				       &modtail );
+
+	be_entry_release_r( op, e );
+
+	mods = smbkrb5pwd_long_mod( ad_smbkrb5pwdCredVersion,
+		cf->cred_generation, mods );
+
+	op->o_tag = LDAP_REQ_MODIFY;
+	op->o_callback = &nullsc;
+	op->o_req_dn = ue->ue_ndn;
+	op->o_req_ndn = ue->ue_ndn;
+	op->orm_modlist = mods;
+	op->orm_no_opattrs = 0;
+	op->o_bd->be_modify( op, &rs );
+	slap_mods_free( mods, 1 );
+
+	return rs.sr_err;
+}
+
+/* Runqueue task that works off the upgrade queue, every
+ * SMBKRB5PWD_UPGRADE_INTERVAL seconds while olcSmbKrb5PwdCredGeneration
+ * is set */
+static void *
+smbkrb5pwd_upgrade( void *ctx, void *arg )
+{
+	struct re_s	*rtask = arg;
+	smbkrb5pwd_t	*pi = rtask->arg;
+	smbkrb5pwd_conf	*cf = smbkrb5pwd_conf_get( pi );
+	Connection	conn = { 0 };
+	OperationBuffer	opbuf;
+	Operation	*op;
+	smbkrb5pwd_upgrade_ent *ue;
+	int		rc;
+
+	connection_fake_init( &conn, &opbuf, ctx );
+	op = &opbuf.ob_op;
+	op->o_bd = pi->be;
+	op->o_dn = op->o_bd->be_rootdn;
+	op->o_ndn = op->o_bd->be_rootndn;
+
+	while ( !slapd_shutdown ) {
+		ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+		ue = pi->upgrade_queue;
+		if ( ue ) {
+			pi->upgrade_queue = ue->ue_next;
+			if ( pi->upgrade_queue == NULL )
+				pi->upgrade_tail = &pi->upgrade_queue;
+			pi->upgrade_nqueue--;
+		}
+		ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+		if ( ue == NULL )
+			break;
+
+		rc = smbkrb5pwd_upgrade_one( op, pi, cf, ue );
+		if ( rc == LDAP_SUCCESS ) {
+			Log1(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO,
+			     "smbkrb5pwd : upgraded credentials of %s\n",
+			     ue->ue_ndn.bv_val);
+		} else {
+			Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+			     "smbkrb5pwd : credential upgrade of %s"
+			     " failed (%d)\n", ue->ue_ndn.bv_val, rc);
+		}
+
+		ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+		if ( rc == LDAP_SUCCESS )
+			pi->upgrade_done++;
+		else
+			pi->upgrade_failed++;
+		ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+
+		smbkrb5pwd_upgrade_ent_free( ue );
+	}
+
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( ldap_pvt_runqueue_isrunning( &slapd_rq, rtask ) )
+		ldap_pvt_runqueue_stoptask( &slapd_rq, rtask );
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+
+	return NULL;
+}
+
+/* Start upgrading on bind; called from db_open or from back-config with
+ * the thread pool paused, like smbkrb5pwd_restamp_schedule() */
+static void
+smbkrb5pwd_upgrade_schedule( smbkrb5pwd_t *pi )
+{
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( pi->upgrade_task == NULL ) {
+		pi->upgrade_task = ldap_pvt_runqueue_insert( &slapd_rq,
+			SMBKRB5PWD_UPGRADE_INTERVAL, smbkrb5pwd_upgrade, pi,
+			"smbkrb5pwd_upgrade", pi->be->be_suffix[0].bv_val );
+	}
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+}
+
+/* Stop upgrading and drop the queue */
+static void
+smbkrb5pwd_upgrade_cancel( smbkrb5pwd_t *pi )
+{
+	smbkrb5pwd_upgrade_ent *ue;
+
+	ldap_pvt_thread_mutex_lock( &slapd_rq.rq_mutex );
+	if ( pi->upgrade_task ) {
+		struct re_s *re = pi->upgrade_task;
+
+		pi->upgrade_task = NULL;
+		if ( ldap_pvt_runqueue_isrunning( &slapd_rq, re ) )
+			ldap_pvt_runqueue_stoptask( &slapd_rq, re );
+		ldap_pvt_runqueue_remove( &slapd_rq, re );
+	}
+	ldap_pvt_thread_mutex_unlock( &slapd_rq.rq_mutex );
+
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	while ( ( ue = pi->upgrade_queue ) != NULL ) {
+		pi->upgrade_queue = ue->ue_next;
+		smbkrb5pwd_upgrade_ent_free( ue );
+	}
+	pi->upgrade_tail = &pi->upgrade_queue;
+	pi->upgrade_nqueue = 0;
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+}
+
+/*
+ * Batch password modify
+ *
+ * An extended operation that changes the passwords of several entries
+ * with one request, for tools that reset the passwords of a whole
+ * group. The request value is
+ *
+ *	SEQUENCE OF SEQUENCE {
+ *		userIdentity	OCTET STRING,	-- LDAPDN
+ *		newPasswd	OCTET STRING }
+ *
+ * and the response value holds a result for every entry, in order:
+ *
+ *	SEQUENCE OF SEQUENCE {
+ *		resultCode		ENUMERATED,
+ *		diagnosticMessage	OCTET STRING }
+ *
+ * Every entry is checked like a PasswordModify of its own and modified
+ * as the requesting identity. The kerberos changes of the entries are
+ * handed to the helpers of their realm in chunks, so that they run in
+ * parallel.
+ */
+#define SMBKRB5PWD_EXOP_BATCH	"1.3.6.1.4.1.4203.666.11.13.3"
+#define SMBKRB5PWD_BATCH_MAX	256
+#define SMBKRB5PWD_BATCH_CHUNK	16	/* slots reserved at once */
+
+static const struct berval smbkrb5pwd_exop_batch_oid =
+	BER_BVC( SMBKRB5PWD_EXOP_BATCH );
+
+typedef struct smbkrb5pwd_batch_ent {
+	struct berval		bt_dn;
+	struct berval		bt_ndn;
+	struct berval		bt_pw;		/* NUL terminated copy */
+	int			bt_rc;
+	const char		*bt_text;
+	int			bt_krb5;	/* kerberos change pending */
+	smbkrb5pwd_krb5_req	bt_kr;
+	Modifications		*bt_mods;
+	Modifications		**bt_modtail;
+} smbkrb5pwd_batch_ent;
+
+/* Check an entry of the batch and prepare its modifications */
+static void
+smbkrb5pwd_batch_prepare(
+	Operation *op,
+	smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf,
+	smbkrb5pwd_batch_ent *bt )
+{
+	Entry *e;
+
+	if ( dnNormalize( 0, NULL, NULL, &bt->bt_dn, &bt->bt_ndn,
+			  op->o_tmpmemctx ) != LDAP_SUCCESS ) {
+		bt->bt_rc = LDAP_INVALID_DN_SYNTAX;
+		bt->bt_text = "invalid DN";
+		return;
+	}
+
+	if ( !dnIsSuffix( &bt->bt_ndn, &op->o_bd->be_nsuffix[0] ) ) {
+		bt->bt_rc = LDAP_UNWILLING_TO_PERFORM;
+		bt->bt_text = "entry is not in the database of the first entry";
+		return;
+	}
+
+	if ( BER_BVISEMPTY( &bt->bt_pw ) ) {
+		bt->bt_rc = LDAP_UNWILLING_TO_PERFORM;
+		bt->bt_text = "a new password is required";
+		return;
+	}
+
+	bt->bt_rc = be_entry_get_rw( op, &bt->bt_ndn, NULL, NULL, 0, &e );
+	if ( bt->bt_rc != LDAP_SUCCESS ) {
+		return;
+	}
+
+	/* before kerberos is changed, which the modify cannot undo */
+	if ( !access_allowed( op, e, slap_schema.si_ad_userPassword, NULL,
+			      ACL_WRITE, NULL ) ) {
+		bt->bt_rc = LDAP_INSUFFICIENT_ACCESS;
+		bt->bt_text = "not allowed to change the password";
+		goto done;
+	}
+
+	if ( cf->oc_requiredObjectclass &&
+	     !is_entry_objectclass( e, cf->oc_requiredObjectclass, 0 ) ) {
+		bt->bt_rc = LDAP_PARAM_ERROR;
+		bt->bt_text = "entry is not of the required objectClass";
+		goto done;
+	}
+
+	if ( SMBKRB5PWD_DO_KRB5( cf ) ) {
+		bt->bt_rc = smbkrb5pwd_krb5_prepare( op, pi, cf, e, &bt->bt_pw,
+						     &bt->bt_kr, &bt->bt_text );
+		if ( bt->bt_rc != LDAP_SUCCESS )
+			goto done;
+		bt->bt_krb5 = !smbkrb5pwd_dedupe_find( pi, cf, &bt->bt_kr,
+						       &bt->bt_pw );
+	}
+
+	if ( SMBKRB5PWD_DO_SAMBA( cf ) &&
+	     is_entry_objectclass( e, oc_sambaSamAccount, 0 ) ) {
+		smbkrb5pwd_samba_mods( op, pi, cf, &bt->bt_pw, 1, &bt->bt_mods,
+				       &bt->bt_modtail );
+	}
+
+	if ( cf->cred_generation ) {
+		bt->bt_mods = smbkrb5pwd_long_mod( ad_smbkrb5pwdCredVersion,
+			cf->cred_generation, bt->bt_mods );
+		if ( !bt->bt_modtail )
+			bt->bt_modtail = &bt->bt_mods->sml_next;
+	}
+
+	/* what the frontend adds to a PasswordModify */
+	if ( !SMBKRB5PWD_DO_KRB5( cf ) || cf->keep_sasl_id != 1 ||
+	     !smbkrb5pwd_keep_sasl( e, &bt->bt_mods, &bt->bt_modtail ) ) {
+		struct berval hash = BER_BVNULL;
+
+		slap_passwd_hash( &bt->bt_pw, &hash, &bt->bt_text );
+		if ( BER_BVISNULL( &hash ) ) {
+			bt->bt_rc = LDAP_OTHER;
+			bt->bt_krb5 = 0;
+			goto done;
+		}
+		bt->bt_mods = smbkrb5pwd_bv_mod( slap_schema.si_ad_userPassword,
+						 &hash, bt->bt_mods );
+		/* checked by the ACLs of the backend like any modify */
+		bt->bt_mods->sml_flags = 0;
+		if ( !bt->bt_modtail )
+			bt->bt_modtail = &bt->bt_mods->sml_next;
+	}
+
+done:
+	be_entry_release_r( op, e );
+}
+
+/* Run the pending kerberos changes of the realm of bts[first] */
+static void
+smbkrb5pwd_batch_krb5(
+	Operation *op,
+	smbkrb5pwd_t *pi,
+	smbkrb5pwd_conf *cf,
+	smbkrb5pwd_batch_ent *bts,
+	int n,
+	int first )
+{
+	smbkrb5pwd_realm *rm = bts[first].bt_kr.kr_realm;
+	smbkrb5pwd_batch_ent *chunk[ SMBKRB5PWD_BATCH_CHUNK ];
+	smbkrb5pwd_slot *slots[ SMBKRB5PWD_BATCH_CHUNK ];
+	struct timespec ts;
+	int i, k, rc;
+
+	do {
+		for ( i = first, k = 0; i < n && k < SMBKRB5PWD_BATCH_CHUNK; i++ ) {
+			if ( bts[i].bt_krb5 && bts[i].bt_kr.kr_realm == rm )
+				chunk[k++] = &bts[i];
+		}
+		if ( k == 0 )
+			break;
+
+		smbkrb5pwd_slot_get_n( rm->rm_pool, SMBKRB5PWD_LANE_BULK,
+				       slots, k );
+		for ( i = 0; i < k; i++ ) {
+			smbkrb5pwd_krb5_fill( op, &chunk[i]->bt_kr,
+					      &chunk[i]->bt_pw, slots[i] );
+			SMBKRB5PWD_PROBE_OP( SMBKRB5PWD_PH_KRB5, op,
+					     chunk[i]->bt_kr.kr_princ );
+		}
+
+		smbkrb5pwd_trace_begin( &ts );
+		smbkrb5pwd_submit( rm->rm_pool, slots, k );
+
+		for ( i = 0; i < k; i++ ) {
+			rc = smbkrb5pwd_wait( rm, slots[i] );
+			smbkrb5pwd_trace( pi, op, SMBKRB5PWD_PH_KRB5, &ts,
+					  slots[i]->sl_kadm5, rc );
+			smbkrb5pwd_shadow_mirror( op, pi, cf, &chunk[i]->bt_kr,
+						  &chunk[i]->bt_pw, slots[i], rc );
+			smbkrb5pwd_dedupe_note( pi, cf, &chunk[i]->bt_kr,
+						&chunk[i]->bt_pw, rc );
+			if ( rc != LDAP_SUCCESS ) {
+				Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+				     "smbkrb5pwd %s : kerberos password change"
+				     " of %s failed: %s\n",
+				     op->o_log_prefix, slots[i]->sl_princ,
+				     slots[i]->sl_text);
+				chunk[i]->bt_rc = rc;
+				chunk[i]->bt_text = smbkrb5pwd_slot_text( op,
+								slots[i] );
+			} else {
+				smbkrb5pwd_krb5_mods( &chunk[i]->bt_kr, slots[i],
+						      &chunk[i]->bt_mods,
+						      &chunk[i]->bt_modtail );
 			}
+			chunk[i]->bt_krb5 = 0;
+			smbkrb5pwd_slot_put( rm->rm_pool, slots[i] );
 		}
+	} while ( k == SMBKRB5PWD_BATCH_CHUNK );
+}
+
+static int
+smbkrb5pwd_exop_batch( Operation *op, SlapReply *rs )
+{
+	slap_overinst *on = (slap_overinst *)op->o_bd->bd_info;
+	smbkrb5pwd_t *pi = on->on_bi.bi_private;
+	smbkrb5pwd_conf *cf = smbkrb5pwd_conf_get( pi );
+	BerElementBuffer berbuf;
+	BerElement *ber = (BerElement *)&berbuf;
+	smbkrb5pwd_batch_ent *bts = NULL;
+	struct berval dn, pw;
+	ber_tag_t tag;
+	ber_len_t len;
+	char *last;
+	int i, n = 0, rc = LDAP_SUCCESS;
+	struct timespec ts_exop;
+
+	if ( BER_BVISEMPTY( &op->o_ndn ) ) {
+		rs->sr_text = "only authenticated users may change passwords";
+		return LDAP_STRONG_AUTH_REQUIRED;
 	}
 
-	/* Samba stuff */
-	if ( SMBKRB5PWD_DO_SAMBA( pi ) && is_entry_objectclass(e, oc_sambaSamAccount, 0 ) ) {
-		struct berval *keys;
-		ber_len_t j,l;
-		wchar_t *wcs, wc;
-		char *c, *d;
-		struct berval pwd;
-		
-		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
-	     	     "smbkrb5pwd %s : setting samba password",
-	     	     op->o_log_prefix);
+	if ( op->ore_reqdata == NULL ) {
+		rs->sr_text = "no request data";
+		return LDAP_PROTOCOL_ERROR;
+	}
 
-		/* Expand incoming UTF8 string to UCS4 */
-		l = ldap_utf8_chars(qpw->rs_new.bv_val);
-		wcs = ch_malloc((l+1) * sizeof(wchar_t));
+	SMBKRB5PWD_PROBE_OP( SMBKRB5PWD_PH_EXOP, op, op->o_req_ndn.bv_val );
+	smbkrb5pwd_trace_begin( &ts_exop );
 
-		ldap_x_utf8s_to_wcs( wcs, qpw->rs_new.bv_val, l );
-		
-		/* Truncate UCS4 to UCS2 */
-		c = (char *)wcs;
-		for (j=0; j<l; j++) {
-			wc = wcs[j];
-			*c++ = wc & 0xff;
-			*c++ = (wc >> 8) & 0xff;
+	bts = ch_calloc( SMBKRB5PWD_BATCH_MAX, sizeof( smbkrb5pwd_batch_ent ) );
+
+	ber_init2( ber, op->ore_reqdata, 0 );
+	if ( ber_scanf( ber, "{" /*}*/ ) == LBER_ERROR ) {
+		rs->sr_text = "request data decoding error";
+		rc = LDAP_PROTOCOL_ERROR;
+		goto done;
+	}
+	for ( tag = ber_first_element( ber, &len, &last );
+	      tag != LBER_DEFAULT;
+	      tag = ber_next_element( ber, &len, last ) ) {
+		if ( n == SMBKRB5PWD_BATCH_MAX ) {
+			rs->sr_text = "too many entries in the request";
+			rc = LDAP_ADMINLIMIT_EXCEEDED;
+			goto done;
 		}
-		*c++ = 0;
-		pwd.bv_val = (char *)wcs;
-		pwd.bv_len = l * 2;
+		if ( ber_scanf( ber, "{mm}", &dn, &pw ) == LBER_ERROR ) {
+			rs->sr_text = "request data decoding error";
+			rc = LDAP_PROTOCOL_ERROR;
+			goto done;
+		}
+		bts[n].bt_dn = dn;
+		ber_dupbv_x( &bts[n].bt_pw, &pw, op->o_tmpmemctx );
+		n++;
+	}
 
-		ml = ch_malloc(sizeof(Modifications));
-		if (!qpw->rs_modtail) qpw->rs_modtail = &ml->sml_next;
-		ml->sml_next = qpw->rs_mods;
-		qpw->rs_mods = ml;
+	Log2(LDAP_DEBUG_STATS, LDAP_LEVEL_INFO,
+	     "smbkrb5pwd %s : batch password modify of %d entries\n",
+	     op->o_log_prefix, n);
 
-		keys = ch_malloc( 2 * sizeof(struct berval) );
-		BER_BVZERO( &keys[1] );
-		nthash( &pwd, keys );
-		
-		ml->sml_desc = ad_sambaNTPassword;
-		ml->sml_op = LDAP_MOD_REPLACE;
-#ifdef SLAP_MOD_INTERNAL
-		ml->sml_flags = SLAP_MOD_INTERNAL;
-#endif
-		ml->sml_numvals = 1;
-		ml->sml_values = keys;
-		ml->sml_nvalues = NULL;
+	op->o_bd->bd_info = (BackendInfo *)on->on_info;
 
-		ch_free(wcs);
+	for ( i = 0; i < n; i++ ) {
+		smbkrb5pwd_batch_prepare( op, pi, cf, &bts[i] );
+	}
 
-		ml = ch_malloc(sizeof(Modifications));
-		ml->sml_next = qpw->rs_mods;
-		qpw->rs_mods = ml;
+	for ( i = 0; i < n; i++ ) {
+		if ( bts[i].bt_krb5 )
+			smbkrb5pwd_batch_krb5( op, pi, cf, bts, n, i );
+	}
 
-		keys = ch_malloc( 2 * sizeof(struct berval) );
-		keys[0].bv_val = ch_malloc( LDAP_PVT_INTTYPE_CHARS(long) );
-		keys[0].bv_len = snprintf(keys[0].bv_val,
-			LDAP_PVT_INTTYPE_CHARS(long),
-			"%ld", slap_get_time());
-		BER_BVZERO( &keys[1] );
-		
-		ml->sml_desc = ad_sambaPwdLastSet;
-		ml->sml_op = LDAP_MOD_REPLACE;
-#ifdef SLAP_MOD_INTERNAL
-		ml->sml_flags = SLAP_MOD_INTERNAL;
-#endif
-		ml->sml_numvals = 1;
-		ml->sml_values = keys;
-		ml->sml_nvalues = NULL;
+	/* modify as the requestor, through all overlays of the database */
+	for ( i = 0; i < n; i++ ) {
+		Operation op2 = *op;
+		SlapReply rs2 = { REP_RESULT };
+		slap_callback cb = { NULL, slap_null_cb, NULL, NULL };
+
+		if ( bts[i].bt_rc != LDAP_SUCCESS )
+			continue;
+
+		op2.o_tag = LDAP_REQ_MODIFY;
+		op2.o_callback = &cb;
+		op2.o_req_dn = bts[i].bt_dn;
+		op2.o_req_ndn = bts[i].bt_ndn;
+		op2.orm_modlist = bts[i].bt_mods;
+		op2.orm_no_opattrs = 0;
+		op2.o_bd->be_modify( &op2, &rs2 );
+
+		bts[i].bt_rc = rs2.sr_err;
+		bts[i].bt_text = rs2.sr_text;
+	}
 
-		if (pi->smb_must_change)
-		{
-			ml = ch_malloc(sizeof(Modifications));
-			ml->sml_next = qpw->rs_mods;
-			qpw->rs_mods = ml;
+	op->o_bd->bd_info = (BackendInfo *)on;
 
-			keys = ch_malloc( 2 * sizeof(struct berval) );
-			keys[0].bv_val = ch_malloc( LDAP_PVT_INTTYPE_CHARS(long) );
-			keys[0].bv_len = snprintf(keys[0].bv_val,
-					LDAP_PVT_INTTYPE_CHARS(long),
-					"%ld", slap_get_time() + pi->smb_must_change);
-			BER_BVZERO( &keys[1] );
+	ber_init_w_nullc( ber, LBER_USE_DER );
+	ber_printf( ber, "{" /*}*/ );
+	for ( i = 0; i < n; i++ ) {
+		ber_printf( ber, "{es}", (ber_int_t)bts[i].bt_rc,
+			    bts[i].bt_text ? bts[i].bt_text : "" );
+	}
+	ber_printf( ber, /*{*/ "N}" );
+	if ( ber_flatten( ber, &rs->sr_rspdata ) < 0 ) {
+		rs->sr_text = "response encoding error";
+		rc = LDAP_OTHER;
+	} else {
+		rs->sr_rspoid = ch_strdup( SMBKRB5PWD_EXOP_BATCH );
+	}
+	ber_free_buf( ber );
+
+done:
+	for ( i = 0; i < n; i++ ) {
+		smbkrb5pwd_wipe( bts[i].bt_pw.bv_val, bts[i].bt_pw.bv_len );
+		op->o_tmpfree( bts[i].bt_pw.bv_val, op->o_tmpmemctx );
+		if ( !BER_BVISNULL( &bts[i].bt_ndn ) )
+			op->o_tmpfree( bts[i].bt_ndn.bv_val, op->o_tmpmemctx );
+		if ( bts[i].bt_mods )
+			slap_mods_free( bts[i].bt_mods, 1 );
+	}
+	ch_free( bts );
 
-			ml->sml_desc = ad_sambaPwdMustChange;
-			ml->sml_op = LDAP_MOD_REPLACE;
-#ifdef SLAP_MOD_INTERNAL
-			ml->sml_flags = SLAP_MOD_INTERNAL;
-#endif
-			ml->sml_numvals = 1;
-			ml->sml_values = keys;
-			ml->sml_nvalues = NULL;
+	smbkrb5pwd_trace( pi, op, SMBKRB5PWD_PH_EXOP, &ts_exop, 0, rc );
+	smbkrb5pwd_trace_done( pi, op, &ts_exop, rc );
+
+	return rc;
+}
+
+/* Frontend handler of the batch extended operation: hand it to the
+ * database of the first entry, where smbkrb5pwd_exop_passwd() of the
+ * overlay takes it */
+static int
+smbkrb5pwd_batch_extop( Operation *op, SlapReply *rs )
+{
+	BerElementBuffer berbuf;
+	BerElement *ber = (BerElement *)&berbuf;
+	struct berval dn = BER_BVNULL, ndn;
+	int rc;
+
+	if ( BER_BVISEMPTY( &op->o_ndn ) ) {
+		rs->sr_text = "only authenticated users may change passwords";
+		return LDAP_STRONG_AUTH_REQUIRED;
+	}
+
+	if ( op->ore_reqdata == NULL ) {
+		rs->sr_text = "no request data";
+		return LDAP_PROTOCOL_ERROR;
+	}
+
+	ber_init2( ber, op->ore_reqdata, 0 );
+	if ( ber_scanf( ber, "{{m" /*}}*/, &dn ) == LBER_ERROR ) {
+		rs->sr_text = "request data decoding error";
+		return LDAP_PROTOCOL_ERROR;
+	}
+
+	if ( dnNormalize( 0, NULL, NULL, &dn, &ndn, op->o_tmpmemctx )
+	     != LDAP_SUCCESS ) {
+		rs->sr_text = "invalid DN";
+		return LDAP_INVALID_DN_SYNTAX;
+	}
+
+	op->o_bd = select_backend( &ndn, 0 );
+	op->o_req_dn = ndn;
+	op->o_req_ndn = ndn;
+
+	if ( op->o_bd == NULL || op->o_bd->be_extended == NULL ) {
+		rs->sr_text = "no smbkrb5pwd database for the entries";
+		rc = LDAP_UNWILLING_TO_PERFORM;
+	} else if ( backend_check_restrictions( op, rs,
+			(struct berval *)&smbkrb5pwd_exop_batch_oid )
+		    != LDAP_SUCCESS ) {
+		rc = rs->sr_err;
+	} else {
+		rc = op->o_bd->be_extended( op, rs );
+		if ( rc == SLAP_CB_CONTINUE ) {
+			rs->sr_text = "no smbkrb5pwd database for the entries";
+			rc = LDAP_UNWILLING_TO_PERFORM;
 		}
+	}
 
-		if (pi->smb_can_change)
-		{
-			ml = ch_malloc(sizeof(Modifications));
-			ml->sml_next = qpw->rs_mods;
-			qpw->rs_mods = ml;
+	op->o_tmpfree( ndn.bv_val, op->o_tmpmemctx );
+	BER_BVZERO( &op->o_req_dn );
+	BER_BVZERO( &op->o_req_ndn );
 
-			keys = ch_malloc( 2 * sizeof(struct berval) );
-			keys[0].bv_val = ch_malloc( LDAP_PVT_INTTYPE_CHARS(long) );
-			keys[0].bv_len = snprintf(keys[0].bv_val,
-					LDAP_PVT_INTTYPE_CHARS(long),
-					"%ld", slap_get_time() + pi->smb_can_change);
-			BER_BVZERO( &keys[1] );
+	return rc;
+}
 
-			ml->sml_desc = ad_sambaPwdCanChange;
-			ml->sml_op = LDAP_MOD_REPLACE;
-#ifdef SLAP_MOD_INTERNAL
-			ml->sml_flags = SLAP_MOD_INTERNAL;
-#endif
-			ml->sml_numvals = 1;
-			ml->sml_values = keys;
-			ml->sml_nvalues = NULL;
+static int smbkrb5pwd_exop_passwd(
+	Operation *op,
+	SlapReply *rs)
+{
+	int rc, rc_krb5;
+	req_pwdexop_s *qpw = &op->oq_pwdexop;
+	Entry *e;
+	slap_overinst *on = (slap_overinst *)op->o_bd->bd_info;
+	smbkrb5pwd_t *pi = on->on_bi.bi_private;
+	smbkrb5pwd_conf *cf;
+	char term;
+	struct timespec ts_exop, ts;
+
+	if ( !ber_bvcmp( &smbkrb5pwd_exop_batch_oid, &op->ore_reqoid ) ) {
+		return smbkrb5pwd_exop_batch( op, rs );
+	}
+
+	/* Not the operation we expected, pass it on... */
+	if ( ber_bvcmp( &slap_EXOP_MODIFY_PASSWD, &op->ore_reqoid ) ) {
+		return SLAP_CB_CONTINUE;
+	}
+
+	/* the settings of this change, whatever back-config does meanwhile */
+	cf = smbkrb5pwd_conf_get( pi );
+
+	SMBKRB5PWD_PROBE_OP( SMBKRB5PWD_PH_EXOP, op, op->o_req_ndn.bv_val );
+	smbkrb5pwd_trace_begin( &ts_exop );
+
+	op->o_bd->bd_info = (BackendInfo *)on->on_info;
+	SMBKRB5PWD_PROBE_OP( SMBKRB5PWD_PH_ENTRY, op, op->o_req_ndn.bv_val );
+	smbkrb5pwd_trace_begin( &ts );
+	rc = be_entry_get_rw( op, &op->o_req_ndn, NULL, NULL, 0, &e );
+	smbkrb5pwd_trace( pi, op, SMBKRB5PWD_PH_ENTRY, &ts, 0, rc );
+	if ( rc != LDAP_SUCCESS ) {
+		smbkrb5pwd_trace( pi, op, SMBKRB5PWD_PH_EXOP, &ts_exop, 0, rc );
+		smbkrb5pwd_trace_done( pi, op, &ts_exop, rc );
+		return rc;
+	}
+
+	term = qpw->rs_new.bv_val[qpw->rs_new.bv_len];
+	qpw->rs_new.bv_val[qpw->rs_new.bv_len] = '\0';
+
+	rc = SLAP_CB_CONTINUE;
+	if (cf->oc_requiredObjectclass &&
+	    !is_entry_objectclass(e, cf->oc_requiredObjectclass, 0)) {
+		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_NOTICE,
+	     	     "smbkrb5pwd %s : an entry is not of required"
+		     " objectClass\n",
+	     	     op->o_log_prefix);
+		rc = LDAP_PARAM_ERROR;
+		goto finish;
+	}
+
+	if (SMBKRB5PWD_DO_KRB5(cf)) {
+		/* if this fails, do not bother with samba,
+		   because passwords should be kept in sync */
+		rc_krb5 = krb5_set_passwd(op, rs, qpw, e, pi, cf);
+		if (rc_krb5 != LDAP_SUCCESS) {
+			rc = rc_krb5;
+			goto finish;
 		}
+
+		if (cf->keep_sasl_id == 1)
+			smbkrb5pwd_keep_sasl(e, &qpw->rs_mods, &qpw->rs_modtail);
+	}
+
+	/* Samba stuff */
+	if ( SMBKRB5PWD_DO_SAMBA( cf ) && is_entry_objectclass(e, oc_sambaSamAccount, 0 ) ) {
+		Log1(LDAP_DEBUG_TRACE, LDAP_LEVEL_NOTICE,
+	     	     "smbkrb5pwd %s : setting samba password",
+	     	     op->o_log_prefix);
+
+		SMBKRB5PWD_PROBE_OP( SMBKRB5PWD_PH_SAMBA, op,
+				     e->e_nname.bv_val );
+		smbkrb5pwd_trace_begin( &ts );
+		smbkrb5pwd_samba_mods( op, pi, cf, &qpw->rs_new, 1,
+				       &qpw->rs_mods, &qpw->rs_modtail );
+		smbkrb5pwd_trace( pi, op, SMBKRB5PWD_PH_SAMBA, &ts, 0,
+				  LDAP_SUCCESS );
+	}
+
+	if ( cf->cred_generation ) {
+		qpw->rs_mods = smbkrb5pwd_long_mod( ad_smbkrb5pwdCredVersion,
+			cf->cred_generation, qpw->rs_mods );
+		if ( !qpw->rs_modtail )
+			qpw->rs_modtail = &qpw->rs_mods->sml_next;
 	}
 finish:
 	be_entry_release_r( op, e );
 	qpw->rs_new.bv_val[qpw->rs_new.bv_len] = term;
 
+	smbkrb5pwd_trace( pi, op, SMBKRB5PWD_PH_EXOP, &ts_exop, 0,
+			  rc == SLAP_CB_CONTINUE ? LDAP_SUCCESS : rc );
+	smbkrb5pwd_trace_done( pi, op, &ts_exop,
+			       rc == SLAP_CB_CONTINUE ? LDAP_SUCCESS : rc );
+
 	return rc;
 }
 
@@ -639,6 +4668,25 @@ enum {
 	PC_SMB_KRB5REALM,
 	PC_SMB_REQUIREDCLASS,
 	PC_SMB_KEEP_SASL_ID,
+	PC_SMB_TRACE_FILE,
+	PC_SMB_TRACE_SLOW,
+	PC_SMB_HELPERS,
+	PC_SMB_RESTAMP,
+	PC_SMB_RESTAMP_BATCH,
+	PC_SMB_RESTAMP_INTERVAL,
+	PC_SMB_REALM_MAP,
+	PC_SMB_REALM_ATTR,
+	PC_SMB_KRB5_INLINE,
+	PC_SMB_CRED_GENERATION,
+	PC_SMB_UPGRADE_RATE,
+	PC_SMB_BULK_HELPERS,
+	PC_SMB_BACKGROUND_HELPERS,
+	PC_SMB_SHADOW_REALM,
+	PC_SMB_SHADOW_QUEUE,
+	PC_SMB_PRINCIPAL,
+	PC_SMB_DEDUPE_TTL,
+	PC_SMB_DEDUPE_SIZE,
+	PC_SMB_KRB5_INLINE_BASIC,
 };
 
 static ConfigDriver smbkrb5pwd_cf_func;
@@ -679,6 +4727,101 @@ static ConfigTable smbkrb5pwd_cfats[] = {
 		"( OLcfgCtAt:1.6 NAME 'olcSmbKrb5PwdKeepSaslIdentity' "
 		"DESC 'Keep the SASL id defined in userPassword if password is changed' "
 		"SYNTAX OMsBoolean SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-trace-file", "path",
+		2, 2, 0, ARG_MAGIC|ARG_STRING|PC_SMB_TRACE_FILE, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.7 NAME 'olcSmbKrb5PwdTraceFile' "
+		"DESC 'File for flight recorder events of failed or slow password changes' "
+		"SYNTAX OMsDirectoryString SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-trace-slow", "milliseconds",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_TRACE_SLOW, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.8 NAME 'olcSmbKrb5PwdTraceSlow' "
+		"DESC 'Password changes taking longer are written to the trace file' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-helpers", "count",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_HELPERS, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.9 NAME 'olcSmbKrb5PwdHelpers' "
+		"DESC 'Number of kerberos helper processes' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-restamp", "on|off",
+		2, 2, 0, ARG_MAGIC|ARG_ON_OFF|PC_SMB_RESTAMP, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.10 NAME 'olcSmbKrb5PwdRestamp' "
+		"DESC 'Re-stamp samba expiry times when the intervals change' "
+		"SYNTAX OMsBoolean SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-restamp-batch", "entries",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_RESTAMP_BATCH, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.11 NAME 'olcSmbKrb5PwdRestampBatch' "
+		"DESC 'Entries re-stamped per batch' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-restamp-interval", "seconds",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_RESTAMP_INTERVAL, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.12 NAME 'olcSmbKrb5PwdRestampInterval' "
+		"DESC 'Seconds between re-stamping batches' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-realm-map", "realm> <base",
+		2, 3, 0, ARG_MAGIC|PC_SMB_REALM_MAP, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.13 NAME 'olcSmbKrb5PwdRealmMap' "
+		"DESC 'Kerberos realm of the entries below a base' "
+		"SYNTAX OMsDirectoryString )", NULL, NULL },
+	{ "smbkrb5pwd-realm-attr", "attribute",
+		2, 2, 0, ARG_MAGIC|ARG_STRING|PC_SMB_REALM_ATTR, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.14 NAME 'olcSmbKrb5PwdRealmAttr' "
+		"DESC 'Attribute holding the kerberos realm of an entry' "
+		"SYNTAX OMsDirectoryString SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-krb5-inline", "on|off",
+		2, 2, 0, ARG_MAGIC|ARG_ON_OFF|PC_SMB_KRB5_INLINE, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.15 NAME 'olcSmbKrb5PwdKrb5Inline' "
+		"DESC 'Write the kerberos keys of LDAP KDB principals with the password' "
+		"SYNTAX OMsBoolean SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-cred-generation", "generation",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_CRED_GENERATION, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.16 NAME 'olcSmbKrb5PwdCredGeneration' "
+		"DESC 'Upgrade credentials of older generations on simple bind' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-upgrade-rate", "per-hour",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_UPGRADE_RATE, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.17 NAME 'olcSmbKrb5PwdUpgradeRate' "
+		"DESC 'Credential upgrades per hour' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-bulk-helpers", "helpers",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_BULK_HELPERS, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.18 NAME 'olcSmbKrb5PwdBulkHelpers' "
+		"DESC 'Kerberos helpers batch password changes may use at once' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-background-helpers", "helpers",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_BACKGROUND_HELPERS, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.19 NAME 'olcSmbKrb5PwdBackgroundHelpers' "
+		"DESC 'Kerberos helpers credential upgrades may use at once' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-shadow-realm", "realm> <admin-server",
+		2, 3, 0, ARG_MAGIC|PC_SMB_SHADOW_REALM, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.20 NAME 'olcSmbKrb5PwdShadowRealm' "
+		"DESC 'Kerberos realm and admin server kerberos changes are mirrored to' "
+		"SYNTAX OMsDirectoryString SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-shadow-queue", "changes",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_SHADOW_QUEUE, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.21 NAME 'olcSmbKrb5PwdShadowQueue' "
+		"DESC 'Shadow changes queued at most before dropping' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-principal", "template",
+		2, 2, 0, ARG_MAGIC|ARG_STRING|PC_SMB_PRINCIPAL, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.22 NAME 'olcSmbKrb5PwdPrincipal' "
+		"DESC 'Template of the kerberos principal of an entry' "
+		"SYNTAX OMsDirectoryString SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-dedupe-ttl", "seconds",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_DEDUPE_TTL, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.23 NAME 'olcSmbKrb5PwdDedupeTTL' "
+		"DESC 'Seconds a repeated kerberos change is skipped for' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-dedupe-size", "entries",
+		2, 2, 0, ARG_MAGIC|ARG_INT|PC_SMB_DEDUPE_SIZE, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.24 NAME 'olcSmbKrb5PwdDedupeSize' "
+		"DESC 'Recent kerberos changes remembered at most' "
+		"SYNTAX OMsInteger SINGLE-VALUE )", NULL, NULL },
+	{ "smbkrb5pwd-krb5-inline-basic-checks", "on|off",
+		2, 2, 0, ARG_MAGIC|ARG_ON_OFF|PC_SMB_KRB5_INLINE_BASIC, smbkrb5pwd_cf_func,
+		"( OLcfgCtAt:1.25 NAME 'olcSmbKrb5PwdKrb5InlineBasicChecks' "
+		"DESC 'Accept that inline kerberos changes skip dictionary and pwqual checks' "
+		"SYNTAX OMsBoolean SINGLE-VALUE )", NULL, NULL },
 
 	{ NULL, NULL, 0, 0, 0, ARG_IGNORED }
 };
@@ -695,6 +4838,25 @@ static ConfigOCs smbkrb5pwd_cfocs[] = {
 			"$ olcSmbKrb5PwdKrb5Realm "
 			"$ olcSmbKrb5PwdRequiredClass "
 			"$ olcSmbKrb5PwdKeepSaslIdentity "
+			"$ olcSmbKrb5PwdTraceFile "
+			"$ olcSmbKrb5PwdTraceSlow "
+			"$ olcSmbKrb5PwdHelpers "
+			"$ olcSmbKrb5PwdRestamp "
+			"$ olcSmbKrb5PwdRestampBatch "
+			"$ olcSmbKrb5PwdRestampInterval "
+			"$ olcSmbKrb5PwdRealmMap "
+			"$ olcSmbKrb5PwdRealmAttr "
+			"$ olcSmbKrb5PwdKrb5Inline "
+			"$ olcSmbKrb5PwdCredGeneration "
+			"$ olcSmbKrb5PwdUpgradeRate "
+			"$ olcSmbKrb5PwdBulkHelpers "
+			"$ olcSmbKrb5PwdBackgroundHelpers "
+			"$ olcSmbKrb5PwdShadowRealm "
+			"$ olcSmbKrb5PwdShadowQueue "
+			"$ olcSmbKrb5PwdPrincipal "
+			"$ olcSmbKrb5PwdDedupeTTL "
+			"$ olcSmbKrb5PwdDedupeSize "
+			"$ olcSmbKrb5PwdKrb5InlineBasicChecks "
 		") )", Cft_Overlay, smbkrb5pwd_cfats },
 
 	{ NULL, 0, NULL }
@@ -710,12 +4872,46 @@ static slap_verbmasks smbkrb5pwd_modules[] = {
 	{ BER_BVNULL,			-1 }
 };
 
+static void
+smbkrb5pwd_realm_map_free( smbkrb5pwd_realm_map *mp )
+{
+	ch_free( mp->mp_realm.bv_val );
+	ch_free( mp->mp_base.bv_val );
+	ch_free( mp->mp_nbase.bv_val );
+}
+
+/* Whether realm, the realms of the realm maps and add (each may be NULL)
+ * name more than one realm; a shadow realm can only mirror a single
+ * one, the principals of several would collide in it */
+static int
+smbkrb5pwd_realms_multiple( smbkrb5pwd_t *pi, const char *realm,
+	const char *add )
+{
+	int i;
+
+	if ( realm == NULL ) {
+		realm = add;
+	} else if ( add != NULL && strcmp( realm, add ) ) {
+		return 1;
+	}
+
+	for ( i = 0; i < pi->nrealm_maps; i++ ) {
+		if ( realm == NULL ) {
+			realm = pi->realm_maps[i].mp_realm.bv_val;
+		} else if ( strcmp( realm, pi->realm_maps[i].mp_realm.bv_val ) ) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 static int
 smbkrb5pwd_cf_func( ConfigArgs *c )
 {
 	slap_overinst	*on = (slap_overinst *)c->bi;
 
-	int		rc = 0;
+	int		rc = 0, i;
 	smbkrb5pwd_t	*pi = on->on_bi.bi_private;
 
 	if ( c->op == SLAP_CONFIG_EMIT ) {
@@ -737,10 +4933,156 @@ smbkrb5pwd_cf_func( ConfigArgs *c )
 				}
 			}
 			break;
+
+		case PC_SMB_KRB5REALM:
+			if ( pi->kerberos_realm ) {
+				c->value_string = ch_strdup( pi->kerberos_realm );
+			} else {
+				rc = 1;
+			}
+			break;
+
+		case PC_SMB_REQUIREDCLASS:
+			if ( pi->oc_requiredObjectclass ) {
+				c->value_string = ch_strdup(
+					pi->oc_requiredObjectclass->soc_cname.bv_val );
+			} else {
+				rc = 1;
+			}
+			break;
+
 		case PC_SMB_KEEP_SASL_ID:
 			c->value_int = pi->keep_sasl_id;
 			break;
 
+		case PC_SMB_TRACE_FILE:
+			if ( pi->trace_file ) {
+				c->value_string = ch_strdup( pi->trace_file );
+			} else {
+				rc = 1;
+			}
+			break;
+
+		case PC_SMB_TRACE_SLOW:
+			c->value_int = pi->trace_slow;
+			break;
+
+		case PC_SMB_HELPERS:
+			c->value_int = pi->helpers;
+			break;
+
+		case PC_SMB_REALM_MAP:
+			for ( i = 0; i < pi->nrealm_maps; i++ ) {
+				smbkrb5pwd_realm_map *mp = &pi->realm_maps[i];
+				struct berval bv;
+
+				if ( BER_BVISEMPTY( &mp->mp_base ) ) {
+					value_add_one( &c->rvalue_vals, &mp->mp_realm );
+					continue;
+				}
+				bv.bv_len = mp->mp_realm.bv_len + STRLENOF( " \"\"" )
+					+ mp->mp_base.bv_len;
+				bv.bv_val = ch_malloc( bv.bv_len + 1 );
+				snprintf( bv.bv_val, bv.bv_len + 1, "%s \"%s\"",
+					  mp->mp_realm.bv_val, mp->mp_base.bv_val );
+				ber_bvarray_add( &c->rvalue_vals, &bv );
+			}
+			if ( c->rvalue_vals == NULL )
+				rc = 1;
+			break;
+
+		case PC_SMB_REALM_ATTR:
+			if ( pi->realm_attr ) {
+				value_add_one( &c->rvalue_vals,
+					       &pi->realm_attr->ad_cname );
+			} else {
+				rc = 1;
+			}
+			break;
+
+		case PC_SMB_RESTAMP:
+			c->value_int = pi->restamp;
+			break;
+
+		case PC_SMB_KRB5_INLINE:
+			c->value_int = pi->krb5_inline;
+			break;
+
+		case PC_SMB_KRB5_INLINE_BASIC:
+			c->value_int = pi->krb5_inline_basic;
+			break;
+
+		case PC_SMB_RESTAMP_BATCH:
+			c->value_int = pi->restamp_batch;
+			break;
+
+		case PC_SMB_RESTAMP_INTERVAL:
+			c->value_int = pi->restamp_interval;
+			break;
+
+		case PC_SMB_CRED_GENERATION:
+			c->value_int = pi->cred_generation;
+			break;
+
+		case PC_SMB_UPGRADE_RATE:
+			c->value_int = pi->upgrade_rate;
+			break;
+
+		case PC_SMB_BULK_HELPERS:
+			c->value_int = pi->bulk_helpers;
+			if ( !c->value_int )
+				rc = 1;
+			break;
+
+		case PC_SMB_BACKGROUND_HELPERS:
+			c->value_int = pi->background_helpers;
+			if ( !c->value_int )
+				rc = 1;
+			break;
+
+		case PC_SMB_SHADOW_REALM: {
+			struct berval bv;
+
+			if ( pi->shadow_name == NULL ) {
+				rc = 1;
+				break;
+			}
+			if ( pi->shadow_server == NULL ) {
+				ber_str2bv( pi->shadow_name, 0, 1, &bv );
+			} else {
+				bv.bv_len = strlen( pi->shadow_name ) + 1
+					+ strlen( pi->shadow_server );
+				bv.bv_val = ch_malloc( bv.bv_len + 1 );
+				snprintf( bv.bv_val, bv.bv_len + 1, "%s %s",
+					  pi->shadow_name, pi->shadow_server );
+			}
+			ber_bvarray_add( &c->rvalue_vals, &bv );
+			} break;
+
+		case PC_SMB_SHADOW_QUEUE:
+			c->value_int = pi->shadow_max;
+			break;
+
+		case PC_SMB_PRINCIPAL:
+			if ( strcmp( pi->princ_map->pm_template,
+				     SMBKRB5PWD_PRINC_DEFAULT ) ) {
+				c->value_string = ch_strdup(
+					pi->princ_map->pm_template );
+			} else {
+				rc = 1;
+			}
+			break;
+
+		case PC_SMB_DEDUPE_TTL:
+			c->value_int = pi->dedupe_ttl;
+			if ( !c->value_int )
+				rc = 1;
+			break;
+
+		case PC_SMB_DEDUPE_SIZE:
+			c->value_int = pi->dedupe_size;
+			break;
+
 		default:
 			assert( 0 );
 			rc = 1;
@@ -766,107 +5108,553 @@ smbkrb5pwd_cf_func( ConfigArgs *c )
 				pi->mode &= ~m;
 			}
 			break;
+
+		case PC_SMB_KRB5REALM:
+			ch_free( pi->kerberos_realm );
+			pi->kerberos_realm = NULL;
+			smbkrb5pwd_realms_reopen( pi );
+			break;
+
+		case PC_SMB_REQUIREDCLASS:
+			pi->oc_requiredObjectclass = NULL;
+			break;
+
 		case PC_SMB_KEEP_SASL_ID:
 			break;
 
+		case PC_SMB_TRACE_FILE:
+			ch_free( pi->trace_file );
+			pi->trace_file = NULL;
+			break;
+
+		case PC_SMB_TRACE_SLOW:
+			pi->trace_slow = SMBKRB5PWD_TRACE_SLOW;
+			break;
+
+		case PC_SMB_HELPERS:
+			pi->helpers = SMBKRB5PWD_HELPERS;
+			smbkrb5pwd_realms_resize( pi );
+			break;
+
+		case PC_SMB_REALM_MAP:
+			if ( c->valx < 0 ) {
+				for ( i = 0; i < pi->nrealm_maps; i++ )
+					smbkrb5pwd_realm_map_free( &pi->realm_maps[i] );
+				ch_free( pi->realm_maps );
+				pi->realm_maps = NULL;
+				pi->nrealm_maps = 0;
+			} else if ( c->valx < pi->nrealm_maps ) {
+				smbkrb5pwd_realm_map_free( &pi->realm_maps[c->valx] );
+				for ( i = c->valx; i < pi->nrealm_maps - 1; i++ )
+					pi->realm_maps[i] = pi->realm_maps[i + 1];
+				pi->nrealm_maps--;
+			}
+			smbkrb5pwd_realms_reopen( pi );
+			break;
+
+		case PC_SMB_REALM_ATTR:
+			pi->realm_attr = NULL;
+			break;
+
+		case PC_SMB_RESTAMP:
+			pi->restamp = 0;
+			if ( pi->be )
+				smbkrb5pwd_restamp_cancel( pi );
+			break;
+
+		case PC_SMB_RESTAMP_BATCH:
+			pi->restamp_batch = SMBKRB5PWD_RESTAMP_BATCH;
+			break;
+
+		case PC_SMB_KRB5_INLINE:
+			pi->krb5_inline = 0;
+			break;
+
+		case PC_SMB_KRB5_INLINE_BASIC:
+			pi->krb5_inline_basic = 0;
+			break;
+
+		case PC_SMB_RESTAMP_INTERVAL:
+			pi->restamp_interval = SMBKRB5PWD_RESTAMP_INTERVAL;
+			if ( pi->restamp_task )
+				pi->restamp_task->interval.tv_sec = pi->restamp_interval;
+			break;
+
+		case PC_SMB_CRED_GENERATION:
+			pi->cred_generation = 0;
+			if ( pi->be )
+				smbkrb5pwd_upgrade_cancel( pi );
+			break;
+
+		case PC_SMB_UPGRADE_RATE:
+			pi->upgrade_rate = SMBKRB5PWD_UPGRADE_RATE;
+			break;
+
+		case PC_SMB_BULK_HELPERS:
+			pi->bulk_helpers = 0;
+			smbkrb5pwd_realms_caps( pi );
+			break;
+
+		case PC_SMB_BACKGROUND_HELPERS:
+			pi->background_helpers = 0;
+			smbkrb5pwd_realms_caps( pi );
+			break;
+
+		case PC_SMB_SHADOW_REALM:
+			smbkrb5pwd_shadow_close( pi );
+			ch_free( pi->shadow_name );
+			ch_free( pi->shadow_server );
+			pi->shadow_name = NULL;
+			pi->shadow_server = NULL;
+			break;
+
+		case PC_SMB_SHADOW_QUEUE:
+			pi->shadow_max = SMBKRB5PWD_SHADOW_QUEUE;
+			break;
+
+		case PC_SMB_PRINCIPAL: {
+			smbkrb5pwd_princ_map *pm;
+			char err[ 128 ];
+
+			if ( smbkrb5pwd_princ_compile( SMBKRB5PWD_PRINC_DEFAULT,
+					&pm, err, sizeof( err ) ) ) {
+				rc = 1;
+				break;
+			}
+			smbkrb5pwd_princ_free( pi->princ_map );
+			pi->princ_map = pm;
+			} break;
+
+		case PC_SMB_DEDUPE_TTL:
+			pi->dedupe_ttl = 0;
+			smbkrb5pwd_dedupe_reset( pi, pi->dedupe_size );
+			break;
+
+		case PC_SMB_DEDUPE_SIZE:
+			rc = smbkrb5pwd_dedupe_reset( pi,
+						      SMBKRB5PWD_DEDUPE_SIZE );
+			break;
+
 		default:
 			assert( 0 );
 			rc = 1;
 		}
+		if ( rc == 0 )
+			smbkrb5pwd_conf_publish( pi );
 		return rc;
 	}
 
-	switch( c->type ) {
-	case PC_SMB_MUST_CHANGE:
+	switch( c->type ) {
+	case PC_SMB_MUST_CHANGE:
+		if ( c->value_int < 0 ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> invalid negative value \"%d\".",
+				c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+		pi->smb_must_change = c->value_int;
+		if ( pi->be && pi->restamp && SMBKRB5PWD_DO_SAMBA( pi ) )
+			smbkrb5pwd_restamp_schedule( pi );
+		break;
+
+        case PC_SMB_CAN_CHANGE:
+                if ( c->value_int < 0 ) {
+                        Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+                                "<%s> invalid negative value \"%d\".",
+                                c->log, c->argv[ 0 ], 0 );
+                        return 1;
+                }
+                pi->smb_can_change = c->value_int;
+		if ( pi->be && pi->restamp && SMBKRB5PWD_DO_SAMBA( pi ) )
+			smbkrb5pwd_restamp_schedule( pi );
+                break;
+
+	case PC_SMB_ENABLE: {
+		slap_mask_t	mode = pi->mode, m;
+
+		rc = verbs_to_mask( c->argc, c->argv, smbkrb5pwd_modules, &m );
+		if ( rc > 0 ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> unknown module \"%s\".\n",
+				c->log, c->argv[ 0 ], c->argv[ rc ] );
+			return 1;
+		}
+
+		/* only the staged mode; operations see it once
+		 * smbkrb5pwd_conf_publish() runs below */
+		pi->mode |= m;
+
+		{
+			BackendDB	db = *c->be;
+
+			/* Re-initialize the module, because
+			 * the configuration might have changed */
+			db.bd_info = (BackendInfo *)on;
+			rc = smbkrb5pwd_modules_init( pi );
+			if ( rc ) {
+				pi->mode = mode;
+				return 1;
+			}
+		}
+
+		if ( SMBKRB5PWD_DO_KRB5( pi ) &&
+		     !( mode & SMBKRB5PWD_F_KRB5 ) ) {
+			smbkrb5pwd_realms_reopen( pi );
+		}
+
+		} break;
+
+	case PC_SMB_KRB5REALM: {
+		if ( pi->shadow_name &&
+		     smbkrb5pwd_realms_multiple( pi, c->value_string, NULL ) ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> a shadow realm can only mirror one realm.\n",
+				c->log, c->argv[ 0 ], 0 );
+			ch_free( c->value_string );
+			return 1;
+		}
+		ch_free(pi->kerberos_realm);
+		pi->kerberos_realm = c->value_string;
+		/* the admin principal is resolved by smbkrb5pwd_prewarm() */
+		smbkrb5pwd_realms_reopen(pi);
+		break;
+	}
+
+	case PC_SMB_REQUIREDCLASS: {
+		ObjectClass *oc = oc_find(c->value_string);
+
+		if (oc == NULL) {
+			Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_INFO,
+			     "smbkrb5pwd : could not find required "
+			     "objectclass %s\n",
+			     c->value_string);
+			ch_free(c->value_string);
+			return 1;
+		}
+		ch_free(c->value_string);
+		pi->oc_requiredObjectclass = oc;
+		break;
+	}
+	case PC_SMB_KEEP_SASL_ID: {
+		if (c->value_int)
+			pi->keep_sasl_id = 1;
+		else
+			pi->keep_sasl_id = 0;
+		break;
+	}
+	case PC_SMB_TRACE_FILE:
+		ch_free( pi->trace_file );
+		pi->trace_file = c->value_string;
+		break;
+
+	case PC_SMB_TRACE_SLOW:
+		if ( c->value_int < 0 ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> invalid negative value \"%d\".",
+				c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+		pi->trace_slow = c->value_int;
+		break;
+
+	case PC_SMB_HELPERS:
+		if ( c->value_int < 1 || c->value_int > SMBKRB5PWD_SLOTS ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> must be between 1 and %d.\n",
+				c->log, c->argv[ 0 ], SMBKRB5PWD_SLOTS );
+			return 1;
+		}
+		pi->helpers = c->value_int;
+		smbkrb5pwd_realms_resize( pi );
+		break;
+
+	case PC_SMB_REALM_MAP: {
+		smbkrb5pwd_realm_map mp = { BER_BVNULL, BER_BVNULL, BER_BVNULL };
+
+		if ( pi->shadow_name && smbkrb5pwd_realms_multiple( pi,
+				pi->kerberos_realm, c->argv[ 1 ] ) ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> a shadow realm can only mirror one realm.\n",
+				c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+
+		if ( c->argc == 3 ) {
+			struct berval base;
+
+			ber_str2bv( c->argv[ 2 ], 0, 0, &base );
+			if ( dnNormalize( 0, NULL, NULL, &base,
+					  &mp.mp_nbase, NULL ) != LDAP_SUCCESS ) {
+				Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+					"<%s> invalid DN \"%s\".\n",
+					c->log, c->argv[ 0 ], c->argv[ 2 ] );
+				return 1;
+			}
+			ber_dupbv( &mp.mp_base, &base );
+		}
+		ber_str2bv( c->argv[ 1 ], 0, 1, &mp.mp_realm );
+
+		pi->realm_maps = ch_realloc( pi->realm_maps,
+			( pi->nrealm_maps + 1 ) * sizeof( smbkrb5pwd_realm_map ) );
+		pi->realm_maps[ pi->nrealm_maps++ ] = mp;
+		smbkrb5pwd_realms_reopen( pi );
+		} break;
+
+	case PC_SMB_REALM_ATTR: {
+		AttributeDescription *ad = NULL;
+		const char *text;
+
+		if ( slap_str2ad( c->value_string, &ad, &text ) != LDAP_SUCCESS ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> unknown attribute \"%s\".\n",
+				c->log, c->argv[ 0 ], c->value_string );
+			ch_free( c->value_string );
+			return 1;
+		}
+		ch_free( c->value_string );
+		pi->realm_attr = ad;
+		} break;
+
+	case PC_SMB_RESTAMP:
+		pi->restamp = c->value_int ? 1 : 0;
+		if ( pi->be && pi->restamp && SMBKRB5PWD_DO_SAMBA( pi ) )
+			smbkrb5pwd_restamp_schedule( pi );
+		else if ( pi->be && !pi->restamp )
+			smbkrb5pwd_restamp_cancel( pi );
+		break;
+
+	case PC_SMB_RESTAMP_BATCH:
+		if ( c->value_int < 1 ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> must be at least 1.\n",
+				c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+		pi->restamp_batch = c->value_int;
+		break;
+
+	case PC_SMB_RESTAMP_INTERVAL:
+		if ( c->value_int < 1 ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> must be at least 1.\n",
+				c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+		pi->restamp_interval = c->value_int;
+		if ( pi->restamp_task )
+			pi->restamp_task->interval.tv_sec = pi->restamp_interval;
+		break;
+
+	case PC_SMB_CRED_GENERATION:
 		if ( c->value_int < 0 ) {
 			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
-				"<%s> invalid negative value \"%d\".",
+				"<%s> must not be negative.\n",
 				c->log, c->argv[ 0 ], 0 );
 			return 1;
 		}
-		pi->smb_must_change = c->value_int;
+		pi->cred_generation = c->value_int;
+		if ( pi->be && pi->cred_generation )
+			smbkrb5pwd_upgrade_schedule( pi );
+		else if ( pi->be )
+			smbkrb5pwd_upgrade_cancel( pi );
 		break;
 
-        case PC_SMB_CAN_CHANGE:
-                if ( c->value_int < 0 ) {
-                        Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
-                                "<%s> invalid negative value \"%d\".",
-                                c->log, c->argv[ 0 ], 0 );
-                        return 1;
-                }
-                pi->smb_can_change = c->value_int;
-                break;
+	case PC_SMB_UPGRADE_RATE:
+		if ( c->value_int < 1 || c->value_int > 3600000 ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> must be between 1 and 3600000.\n",
+				c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+		pi->upgrade_rate = c->value_int;
+		break;
 
-	case PC_SMB_ENABLE: {
-		slap_mask_t	mode = pi->mode, m;
+	case PC_SMB_BULK_HELPERS:
+	case PC_SMB_BACKGROUND_HELPERS:
+		if ( c->value_int < 1 || c->value_int > SMBKRB5PWD_SLOTS ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> must be between 1 and %d.\n",
+				c->log, c->argv[ 0 ], SMBKRB5PWD_SLOTS );
+			return 1;
+		}
+		if ( c->type == PC_SMB_BULK_HELPERS )
+			pi->bulk_helpers = c->value_int;
+		else
+			pi->background_helpers = c->value_int;
+		smbkrb5pwd_realms_caps( pi );
+		break;
 
-		rc = verbs_to_mask( c->argc, c->argv, smbkrb5pwd_modules, &m );
-		if ( rc > 0 ) {
+	case PC_SMB_SHADOW_REALM:
+#ifdef SMBKRB5PWD_KADM5_SRV
+		/* the server library reads the local database */
+		if ( c->argc == 3 ) {
 			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
-				"<%s> unknown module \"%s\".\n",
-				c->log, c->argv[ 0 ], c->argv[ rc ] );
+				"<%s> admin server is not supported by "
+				"smbkrb5pwd_srv.\n", c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+#endif
+		/* uid@SCHOOL1 and uid@SCHOOL2 would both be uid@SHADOW */
+		if ( smbkrb5pwd_realms_multiple( pi, pi->kerberos_realm, NULL ) ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> cannot mirror more than one realm.\n",
+				c->log, c->argv[ 0 ], 0 );
 			return 1;
 		}
+		smbkrb5pwd_shadow_close( pi );
+		ch_free( pi->shadow_name );
+		ch_free( pi->shadow_server );
+		pi->shadow_name = ch_strdup( c->argv[ 1 ] );
+		pi->shadow_server = c->argc == 3 ?
+			ch_strdup( c->argv[ 2 ] ) : NULL;
+		smbkrb5pwd_shadow_open( pi );
+		break;
 
-		/* we can hijack the smbkrb5pwd_t structure because
-		 * from within the configuration, this is the only
-		 * active thread. */
-		pi->mode |= m;
+	case PC_SMB_SHADOW_QUEUE:
+		if ( c->value_int < 1 || c->value_int > 65536 ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> must be between 1 and 65536.\n",
+				c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+		pi->shadow_max = c->value_int;
+		break;
 
-		{
-			BackendDB	db = *c->be;
+	case PC_SMB_PRINCIPAL: {
+		smbkrb5pwd_princ_map *pm;
 
-			/* Re-initialize the module, because
-			 * the configuration might have changed */
-			db.bd_info = (BackendInfo *)on;
-			rc = smbkrb5pwd_modules_init( pi );
-			if ( rc ) {
-				pi->mode = mode;
-				return 1;
-			}
+		if ( smbkrb5pwd_princ_compile( c->value_string, &pm,
+				c->cr_msg, sizeof( c->cr_msg ) ) ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> %s.\n", c->log, c->argv[ 0 ], c->cr_msg );
+			ch_free( c->value_string );
+			return 1;
 		}
-
+		ch_free( c->value_string );
+		/* no operation holds the old map during the pause */
+		smbkrb5pwd_princ_free( pi->princ_map );
+		pi->princ_map = pm;
 		} break;
 
-	case PC_SMB_KRB5REALM: {
-		if (pi->kerberos_realm)
-			free(pi->kerberos_realm);
-		if ((pi->kerberos_realm = strdup(c->value_string)) == NULL)
+	case PC_SMB_DEDUPE_TTL:
+		if ( c->value_int < 0 || c->value_int > 3600 ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> must be between 0 and 3600.\n",
+				c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+		pi->dedupe_ttl = c->value_int;
+		if ( smbkrb5pwd_dedupe_reset( pi, pi->dedupe_size ) )
 			return 1;
-		rc = lookup_admin_princstr(pi->kerberos_realm,
-					   &pi->admin_princstr);
-		if (rc)
-			return rc;
-		Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_INFO,
-		     "smbkrb5pwd : using admin principal %s\n",
-		      pi->admin_princstr);
 		break;
-	}
 
-	case PC_SMB_REQUIREDCLASS: {
-		if (!(pi->oc_requiredObjectclass = oc_find(c->value_string))) {
-			Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_INFO,
-			     "smbkrb5pwd : could not find required "
-			     "objectclass %s\n",
-			     c->value_string);
+	case PC_SMB_DEDUPE_SIZE:
+		if ( c->value_int < 1 || c->value_int > 1048576 ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> must be between 1 and 1048576.\n",
+				c->log, c->argv[ 0 ], 0 );
 			return 1;
 		}
+		if ( smbkrb5pwd_dedupe_reset( pi, c->value_int ) )
+			return 1;
 		break;
-	}
-	case PC_SMB_KEEP_SASL_ID: {
-		if (c->value_int)
-			pi->keep_sasl_id = 1;
-		else
-			pi->keep_sasl_id = 0;
+
+	case PC_SMB_KRB5_INLINE:
+		if ( !c->value_int ) {
+			pi->krb5_inline = 0;
+			break;
+		}
+#ifdef SMBKRB5PWD_KADM5_SRV
+		if ( smbkrb5pwd_inline_init() ) {
+			Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+				"<%s> needs the kerberos LDAP schema.\n",
+				c->log, c->argv[ 0 ], 0 );
+			return 1;
+		}
+		pi->krb5_inline = 1;
+#else
+		Debug( LDAP_DEBUG_ANY, "%s: smbkrb5pwd: "
+			"<%s> is only supported by smbkrb5pwd_srv.\n",
+			c->log, c->argv[ 0 ], 0 );
+		return 1;
+#endif
 		break;
-	}
+
+	case PC_SMB_KRB5_INLINE_BASIC:
+		pi->krb5_inline_basic = c->value_int;
+		break;
+
 	default:
 		assert( 0 );
 		return 1;
 	}
+	if ( rc == 0 )
+		smbkrb5pwd_conf_publish( pi );
 	return rc;
 }
 
+#ifdef SMBKRB5PWD_KADM5_SRV
+/* Look up the LDAP KDB schema for olcSmbKrb5PwdKrb5Inline */
+static int
+smbkrb5pwd_inline_init( void )
+{
+	static struct {
+		const char		*name;
+		AttributeDescription	**adp;
+	}
+	inline_ad[] = {
+		{ "krbPrincipalName",		&ad_krbPrincipalName },
+		{ "krbPrincipalKey",		&ad_krbPrincipalKey },
+		{ "krbLastPwdChange",		&ad_krbLastPwdChange },
+		{ "krbPasswordExpiration",	&ad_krbPasswordExpiration },
+		{ "krbPwdPolicyReference",	&ad_krbPwdPolicyReference },
+		{ "krbMaxPwdLife",		&ad_krbMaxPwdLife },
+		{ "krbMinPwdLife",		&ad_krbMinPwdLife },
+		{ "krbMinPwdLength",		&ad_krbMinPwdLength },
+		{ "krbMinPwdClasses",		&ad_krbMinPwdClasses },
+		{ "krbPwdHistoryLength",	&ad_krbPwdHistoryLength },
+		{ NULL }
+	};
+	int i, rc;
+
+	if ( oc_krbPrincipalAux != NULL )
+		return 0;
+
+	for ( i = 0; inline_ad[ i ].name != NULL; i++ ) {
+		const char	*text;
+
+		*(inline_ad[ i ].adp) = NULL;
+
+		rc = slap_str2ad( inline_ad[ i ].name, inline_ad[ i ].adp, &text );
+		if ( rc != LDAP_SUCCESS ) {
+			Debug( LDAP_DEBUG_ANY, "smbkrb5pwd: "
+				"unable to find \"%s\" attributeType: %s (%d).\n",
+				inline_ad[ i ].name, text, rc );
+			return rc;
+		}
+	}
+
+	/* only in the schema of newer releases */
+	{
+		const char	*text;
+
+		ad_krbPwdAllowedKeysalts = NULL;
+		(void)slap_str2ad( "krbPwdAllowedKeysalts",
+			&ad_krbPwdAllowedKeysalts, &text );
+	}
+
+	oc_krbPrincipalAux = oc_find( "krbPrincipalAux" );
+	if ( !oc_krbPrincipalAux ) {
+		Debug( LDAP_DEBUG_ANY, "smbkrb5pwd: "
+			"unable to find \"krbPrincipalAux\" objectClass.\n",
+			0, 0, 0 );
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 static int
 smbkrb5pwd_modules_init( smbkrb5pwd_t *pi )
 {
@@ -938,20 +5726,498 @@ smbkrb5pwd_modules_init( smbkrb5pwd_t *pi )
 	return 0;
 }
 
+#ifdef SMBKRB5PWD_MONITOR
+/*
+ * NOTE: uses the experimental OID arc 1.3.6.1.4.1.4203.666.11.13
+ */
+#define SMBKRB5PWD_OLM_AT	"1.3.6.1.4.1.4203.666.11.13.1"
+#define SMBKRB5PWD_OLM_OC	"1.3.6.1.4.1.4203.666.11.13.2"
+
+static AttributeDescription *ad_olmSmbKrb5PwdState;
+static AttributeDescription *ad_olmSmbKrb5PwdRestamp;
+static AttributeDescription *ad_olmSmbKrb5PwdUpgrade;
+static AttributeDescription *ad_olmSmbKrb5PwdLanes;
+static AttributeDescription *ad_olmSmbKrb5PwdShadow;
+static AttributeDescription *ad_olmSmbKrb5PwdDedupe;
+static ObjectClass *oc_olmSmbKrb5Pwd;
+
+static struct {
+	char			*desc;
+	AttributeDescription	**adp;
+} smbkrb5pwd_olm_ad[] = {
+	{ "( " SMBKRB5PWD_OLM_AT ".1 "
+		"NAME 'olmSmbKrb5PwdState' "
+		"DESC 'Readiness of the kerberos backend' "
+		"SYNTAX OMsDirectoryString "
+		"SINGLE-VALUE "
+		"NO-USER-MODIFICATION "
+		"USAGE dSAOperation )",
+		&ad_olmSmbKrb5PwdState },
+	{ "( " SMBKRB5PWD_OLM_AT ".2 "
+		"NAME 'olmSmbKrb5PwdRestamp' "
+		"DESC 'Progress of re-stamping samba expiry times' "
+		"SYNTAX OMsDirectoryString "
+		"SINGLE-VALUE "
+		"NO-USER-MODIFICATION "
+		"USAGE dSAOperation )",
+		&ad_olmSmbKrb5PwdRestamp },
+	{ "( " SMBKRB5PWD_OLM_AT ".3 "
+		"NAME 'olmSmbKrb5PwdUpgrade' "
+		"DESC 'Credential upgrades on bind' "
+		"SYNTAX OMsDirectoryString "
+		"SINGLE-VALUE "
+		"NO-USER-MODIFICATION "
+		"USAGE dSAOperation )",
+		&ad_olmSmbKrb5PwdUpgrade },
+	{ "( " SMBKRB5PWD_OLM_AT ".4 "
+		"NAME 'olmSmbKrb5PwdLanes' "
+		"DESC 'Kerberos requests per priority lane' "
+		"SYNTAX OMsDirectoryString "
+		"SINGLE-VALUE "
+		"NO-USER-MODIFICATION "
+		"USAGE dSAOperation )",
+		&ad_olmSmbKrb5PwdLanes },
+	{ "( " SMBKRB5PWD_OLM_AT ".5 "
+		"NAME 'olmSmbKrb5PwdShadow' "
+		"DESC 'Kerberos changes of the primary and the shadow side by side' "
+		"SYNTAX OMsDirectoryString "
+		"SINGLE-VALUE "
+		"NO-USER-MODIFICATION "
+		"USAGE dSAOperation )",
+		&ad_olmSmbKrb5PwdShadow },
+	{ "( " SMBKRB5PWD_OLM_AT ".6 "
+		"NAME 'olmSmbKrb5PwdDedupe' "
+		"DESC 'Retried kerberos changes that were skipped' "
+		"SYNTAX OMsDirectoryString "
+		"SINGLE-VALUE "
+		"NO-USER-MODIFICATION "
+		"USAGE dSAOperation )",
+		&ad_olmSmbKrb5PwdDedupe },
+	{ NULL }
+};
+
+static struct {
+	char		*desc;
+	ObjectClass	**ocp;
+} smbkrb5pwd_olm_oc[] = {
+	{ "( " SMBKRB5PWD_OLM_OC ".1 "
+		"NAME 'olmSmbKrb5PwdObject' "
+		"DESC 'smbkrb5pwd overlay monitor information' "
+		"SUP top AUXILIARY "
+		"MAY ( "
+			"olmSmbKrb5PwdState "
+			"$ olmSmbKrb5PwdRestamp "
+			"$ olmSmbKrb5PwdUpgrade "
+			"$ olmSmbKrb5PwdLanes "
+			"$ olmSmbKrb5PwdShadow "
+			"$ olmSmbKrb5PwdDedupe "
+		") )",
+		&oc_olmSmbKrb5Pwd },
+	{ NULL }
+};
+
+static void
+smbkrb5pwd_monitor_set( Entry *e, AttributeDescription *ad, struct berval *bv )
+{
+	Attribute	*a;
+
+	a = attr_find( e->e_attrs, ad );
+	assert( a != NULL );
+
+	if ( a->a_nvals != a->a_vals ) {
+		ber_bvreplace( &a->a_nvals[ 0 ], bv );
+	}
+	ber_bvreplace( &a->a_vals[ 0 ], bv );
+}
+
+/* The requests of each lane over all realms, e.g. "interactive
+ * queued=0 running=1 waiting=0 done=812; bulk queued=12 ..." where
+ * queued are submitted to the helpers and waiting are threads waiting
+ * for a slot */
+static void
+smbkrb5pwd_monitor_lanes( smbkrb5pwd_t *pi, char *buf, size_t size,
+	struct berval *bv )
+{
+	unsigned long queued, running, waiting, done;
+	char *ptr = buf, *end = buf + size;
+	int lane, i, j;
+
+	for ( lane = 0; lane < SMBKRB5PWD_LANES && ptr < end; lane++ ) {
+		queued = running = waiting = done = 0;
+		for ( i = 0; i < pi->nrealms; i++ ) {
+			smbkrb5pwd_pool *pool = pi->realms[i]->rm_pool;
+			smbkrb5pwd_ring *ring;
+
+			if ( pool == NULL )
+				continue;
+			ring = pool->pl_ring;
+			for ( j = 0; j < SMBKRB5PWD_SLOTS; j++ ) {
+				if ( __atomic_load_n(
+					&ring->rg_slots[j].sl_state,
+					__ATOMIC_RELAXED ) ==
+				     SMBKRB5PWD_SL_SUBMITTED &&
+				     ring->rg_slots[j].sl_lane ==
+				     (uint32_t)lane )
+					queued++;
+			}
+			running += __atomic_load_n( &ring->rg_running[lane],
+						    __ATOMIC_RELAXED );
+			done += __atomic_load_n( &ring->rg_done[lane],
+						 __ATOMIC_RELAXED );
+			ldap_pvt_thread_mutex_lock( &pool->pl_mutex );
+			waiting += pool->pl_waiting[lane];
+			ldap_pvt_thread_mutex_unlock( &pool->pl_mutex );
+		}
+		ptr += snprintf( ptr, end - ptr,
+			"%s%s queued=%lu running=%lu waiting=%lu done=%lu",
+			lane ? "; " : "", smbkrb5pwd_lanes[lane].ln_name,
+			queued, running, waiting, done );
+	}
+	bv->bv_val = buf;
+	bv->bv_len = ptr < end ? ptr - buf : size - 1;
+}
+
+/* Microseconds below which the given per mille of the changes of ss
+ * finished, rounded up to a power of two */
+static unsigned long
+smbkrb5pwd_shadow_pct( smbkrb5pwd_shadow_stats *ss, int permille )
+{
+	unsigned long n = 0, want;
+	int b;
+
+	if ( ss->ss_changes == 0 )
+		return 0;
+
+	want = ( ss->ss_changes * permille + 999 ) / 1000;
+	for ( b = 0; b < SMBKRB5PWD_SHADOW_BUCKETS - 1; b++ ) {
+		n += ss->ss_hist[ b ];
+		if ( n >= want )
+			break;
+	}
+
+	return 2UL << b;
+}
+
+/* Both sides of the shadow comparison, e.g. "primary changes=812
+ * errors=0 avg=41200us p50=65536us p99=131072us max=98211us; shadow
+ * changes=790 ...; queued=0 dropped=22" */
+static void
+smbkrb5pwd_monitor_shadow( smbkrb5pwd_t *pi, char *buf, size_t size,
+	struct berval *bv )
+{
+	static const char *sides[] = { "primary", "shadow" };
+	smbkrb5pwd_shadow_stats *ss;
+	char *ptr = buf, *end = buf + size;
+	int side;
+
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	for ( side = 0; side < 2 && ptr < end; side++ ) {
+		ss = &pi->shadow_stats[ side ];
+		ptr += snprintf( ptr, end - ptr,
+			"%s changes=%lu errors=%lu avg=%lluus p50=%luus"
+			" p99=%luus max=%luus; ", sides[ side ],
+			ss->ss_changes, ss->ss_errors,
+			ss->ss_changes ? ss->ss_usec / ss->ss_changes : 0,
+			smbkrb5pwd_shadow_pct( ss, 500 ),
+			smbkrb5pwd_shadow_pct( ss, 990 ), ss->ss_max );
+	}
+	if ( ptr < end )
+		ptr += snprintf( ptr, end - ptr, "queued=%d dropped=%lu",
+			pi->shadow_nqueue, pi->shadow_dropped );
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+
+	bv->bv_val = buf;
+	bv->bv_len = ptr < end ? ptr - buf : size - 1;
+}
+
+static int
+smbkrb5pwd_monitor_update(
+	Operation	*op,
+	SlapReply	*rs,
+	Entry		*e,
+	void		*priv )
+{
+	smbkrb5pwd_t	*pi = (smbkrb5pwd_t *)priv;
+	struct berval	bv;
+	char		buf[ 1024 ];
+
+	/* the state of a single realm, else e.g.
+	 * "A.EXAMPLE.ORG:ready B.EXAMPLE.ORG:warming" */
+	if ( pi->nrealms == 1 ) {
+		ber_str2bv( smbkrb5pwd_states[
+			smbkrb5pwd_get_state( pi->realms[0] ) ], 0, 0, &bv );
+	} else if ( pi->nrealms == 0 ) {
+		ber_str2bv( smbkrb5pwd_states[
+			SMBKRB5PWD_DO_KRB5( smbkrb5pwd_conf_get( pi ) ) ?
+			SMBKRB5PWD_S_COLD : SMBKRB5PWD_S_READY ], 0, 0, &bv );
+	} else {
+		char *ptr = buf, *end = buf + sizeof( buf );
+		int i;
+
+		for ( i = 0; i < pi->nrealms && ptr < end; i++ ) {
+			ptr += snprintf( ptr, end - ptr, "%s%s:%s",
+				i ? " " : "", pi->realms[i]->rm_name,
+				smbkrb5pwd_states[
+				smbkrb5pwd_get_state( pi->realms[i] ) ] );
+		}
+		bv.bv_val = buf;
+		bv.bv_len = ptr < end ? ptr - buf : sizeof( buf ) - 1;
+	}
+	smbkrb5pwd_monitor_set( e, ad_olmSmbKrb5PwdState, &bv );
+
+	/* e.g. "writing 1500/5300 failed=2" */
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	bv.bv_val = buf;
+	bv.bv_len = snprintf( buf, sizeof( buf ), "%s %lu/%lu failed=%lu",
+		smbkrb5pwd_restamp_states[ pi->restamp_state ],
+		pi->restamp_done + pi->restamp_failed,
+		pi->restamp_total, pi->restamp_failed );
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+	smbkrb5pwd_monitor_set( e, ad_olmSmbKrb5PwdRestamp, &bv );
+
+	/* e.g. "queued=40 done=38 failed=1 skipped=112" */
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	bv.bv_len = snprintf( buf, sizeof( buf ),
+		"queued=%lu done=%lu failed=%lu skipped=%lu",
+		pi->upgrade_queued, pi->upgrade_done,
+		pi->upgrade_failed, pi->upgrade_skipped );
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+	smbkrb5pwd_monitor_set( e, ad_olmSmbKrb5PwdUpgrade, &bv );
+
+	smbkrb5pwd_monitor_lanes( pi, buf, sizeof( buf ), &bv );
+	smbkrb5pwd_monitor_set( e, ad_olmSmbKrb5PwdLanes, &bv );
+
+	smbkrb5pwd_monitor_shadow( pi, buf, sizeof( buf ), &bv );
+	smbkrb5pwd_monitor_set( e, ad_olmSmbKrb5PwdShadow, &bv );
+
+	/* e.g. "hits=12 misses=5300 size=4096" */
+	ldap_pvt_thread_mutex_lock( &pi->krb5_mutex );
+	bv.bv_val = buf;
+	bv.bv_len = snprintf( buf, sizeof( buf ),
+		"hits=%lu misses=%lu size=%d",
+		pi->dedupe_hits, pi->dedupe_misses,
+		pi->dedupe ? pi->dedupe_size : 0 );
+	ldap_pvt_thread_mutex_unlock( &pi->krb5_mutex );
+	smbkrb5pwd_monitor_set( e, ad_olmSmbKrb5PwdDedupe, &bv );
+
+	return SLAP_CB_CONTINUE;
+}
+
+static int
+smbkrb5pwd_monitor_free(
+	Entry		*e,
+	void		**priv )
+{
+	struct berval	values[ 2 ];
+	Modification	mod = { 0 };
+	const char	*text;
+	char		textbuf[ SLAP_TEXT_BUFLEN ];
+	int		i;
+
+	/* NOTE: if slap_shutdown != 0, priv might have already been freed */
+	*priv = NULL;
+
+	/* Remove objectClass */
+	mod.sm_op = LDAP_MOD_DELETE;
+	mod.sm_desc = slap_schema.si_ad_objectClass;
+	mod.sm_values = values;
+	mod.sm_numvals = 1;
+	values[ 0 ] = oc_olmSmbKrb5Pwd->soc_cname;
+	BER_BVZERO( &values[ 1 ] );
+
+	(void)modify_delete_values( e, &mod, 1, &text,
+		textbuf, sizeof( textbuf ) );
+
+	/* remove attrs */
+	mod.sm_values = NULL;
+	mod.sm_numvals = 0;
+	for ( i = 0; smbkrb5pwd_olm_ad[ i ].desc != NULL; i++ ) {
+		mod.sm_desc = *smbkrb5pwd_olm_ad[ i ].adp;
+		(void)modify_delete_values( e, &mod, 1, &text,
+			textbuf, sizeof( textbuf ) );
+	}
+
+	return SLAP_CB_CONTINUE;
+}
+
+static int
+smbkrb5pwd_monitor_db_open( BackendDB *be )
+{
+	slap_overinst		*on = (slap_overinst *)be->bd_info;
+	smbkrb5pwd_t		*pi = (smbkrb5pwd_t *)on->on_bi.bi_private;
+	Attribute		*a, *next;
+	monitor_callback_t	*cb = NULL;
+	BackendInfo		*mi;
+	monitor_extra_t		*mbe;
+	struct berval		bv = BER_BVC( "0" );
+	int			i, rc = 0;
+
+	if ( !SLAP_DBMONITORING( be ) ) {
+		return 0;
+	}
+
+	mi = backend_info( "monitor" );
+	if ( !mi || !mi->bi_extra ) {
+		SLAP_DBFLAGS( be ) ^= SLAP_DBFLAG_MONITORING;
+		return 0;
+	}
+	mbe = mi->bi_extra;
+
+	/* don't bother if monitor is not configured */
+	if ( !mbe->is_configured() ) {
+		static int warning = 0;
+
+		if ( warning++ == 0 ) {
+			Debug( LDAP_DEBUG_CONFIG, "smbkrb5pwd_monitor_db_open: "
+				"monitoring disabled; "
+				"configure monitor database to enable\n",
+				0, 0, 0 );
+		}
+
+		return 0;
+	}
+
+	/* one for objectClass, one per monitor attribute */
+	for ( i = 0; smbkrb5pwd_olm_ad[ i ].desc != NULL; i++ )
+		;
+	a = attrs_alloc( 1 + i );
+	if ( a == NULL ) {
+		rc = 1;
+		goto cleanup;
+	}
+
+	a->a_desc = slap_schema.si_ad_objectClass;
+	attr_valadd( a, &oc_olmSmbKrb5Pwd->soc_cname, NULL, 1 );
+	next = a->a_next;
+
+	for ( i = 0; smbkrb5pwd_olm_ad[ i ].desc != NULL; i++ ) {
+		next->a_desc = *smbkrb5pwd_olm_ad[ i ].adp;
+		attr_valadd( next, &bv, NULL, 1 );
+		next = next->a_next;
+	}
+
+	cb = ch_calloc( sizeof( monitor_callback_t ), 1 );
+	cb->mc_update = smbkrb5pwd_monitor_update;
+	cb->mc_free = smbkrb5pwd_monitor_free;
+	cb->mc_private = (void *)pi;
+
+	/* make sure the database is registered; then add monitor attributes */
+	BER_BVZERO( &pi->monitor_ndn );
+	rc = mbe->register_overlay( be, on, &pi->monitor_ndn );
+	if ( rc == 0 ) {
+		rc = mbe->register_entry_attrs( &pi->monitor_ndn, a, cb,
+			NULL, 0, NULL );
+	}
+
+cleanup:;
+	if ( rc != 0 ) {
+		if ( cb != NULL ) {
+			ch_free( cb );
+			cb = NULL;
+		}
+
+		if ( a != NULL ) {
+			attrs_free( a );
+			a = NULL;
+		}
+	}
+
+	/* store for cleanup */
+	pi->monitor_cb = (void *)cb;
+
+	/* we don't need to keep track of the attributes, because
+	 * smbkrb5pwd_monitor_free() takes care of everything */
+	if ( a != NULL ) {
+		attrs_free( a );
+	}
+
+	return rc;
+}
+
+static int
+smbkrb5pwd_monitor_db_close( BackendDB *be )
+{
+	slap_overinst	*on = (slap_overinst *)be->bd_info;
+	smbkrb5pwd_t	*pi = (smbkrb5pwd_t *)on->on_bi.bi_private;
+
+	if ( pi->monitor_cb != NULL ) {
+		BackendInfo	*mi = backend_info( "monitor" );
+		monitor_extra_t	*mbe;
+
+		if ( mi && mi->bi_extra ) {
+			mbe = mi->bi_extra;
+			mbe->unregister_entry_callback( &pi->monitor_ndn,
+				(monitor_callback_t *)pi->monitor_cb,
+				NULL, 0, NULL );
+		}
+		pi->monitor_cb = NULL;
+	}
+
+	return 0;
+}
+
+static int
+smbkrb5pwd_monitor_initialize( void )
+{
+	int	i, code;
+
+	for ( i = 0; smbkrb5pwd_olm_ad[ i ].desc != NULL; i++ ) {
+		code = register_at( smbkrb5pwd_olm_ad[ i ].desc,
+			smbkrb5pwd_olm_ad[ i ].adp, 0 );
+		if ( code != LDAP_SUCCESS ) {
+			Debug( LDAP_DEBUG_ANY, "smbkrb5pwd_monitor_initialize: "
+				"register_at #%d failed\n", i, 0, 0 );
+			return code;
+		}
+		(*smbkrb5pwd_olm_ad[ i ].adp)->ad_type->sat_flags |= SLAP_AT_HIDE;
+	}
+
+	for ( i = 0; smbkrb5pwd_olm_oc[ i ].desc != NULL; i++ ) {
+		code = register_oc( smbkrb5pwd_olm_oc[ i ].desc,
+			smbkrb5pwd_olm_oc[ i ].ocp, 0 );
+		if ( code != LDAP_SUCCESS ) {
+			Debug( LDAP_DEBUG_ANY, "smbkrb5pwd_monitor_initialize: "
+				"register_oc #%d failed\n", i, 0, 0 );
+			return code;
+		}
+		(*smbkrb5pwd_olm_oc[ i ].ocp)->soc_flags |= SLAP_OC_HIDE;
+	}
+
+	return 0;
+}
+#endif /* SMBKRB5PWD_MONITOR */
+
 static int
 smbkrb5pwd_db_init(BackendDB *be, ConfigReply *cr)
 {
 	slap_overinst	*on = (slap_overinst *)be->bd_info;
 	smbkrb5pwd_t	*pi;
+	char		err[ 128 ];
 
 	pi = ch_calloc( 1, sizeof( smbkrb5pwd_t ) );
 	if ( pi == NULL ) {
 		return 1;
 	}
-	pi->admin_princstr = NULL;
 	pi->kerberos_realm = NULL;
 	pi->oc_requiredObjectclass = NULL;
 	ldap_pvt_thread_mutex_init(&pi->krb5_mutex);
+	pi->trace_slow = SMBKRB5PWD_TRACE_SLOW;
+	pi->helpers = SMBKRB5PWD_HELPERS;
+	pi->restamp_batch = SMBKRB5PWD_RESTAMP_BATCH;
+	pi->restamp_interval = SMBKRB5PWD_RESTAMP_INTERVAL;
+	pi->upgrade_rate = SMBKRB5PWD_UPGRADE_RATE;
+	pi->upgrade_tail = &pi->upgrade_queue;
+	pi->shadow_max = SMBKRB5PWD_SHADOW_QUEUE;
+	pi->shadow_tail = &pi->shadow_queue;
+	pi->dedupe_size = SMBKRB5PWD_DEDUPE_SIZE;
+	if ( smbkrb5pwd_princ_compile( SMBKRB5PWD_PRINC_DEFAULT,
+			&pi->princ_map, err, sizeof( err ) ) ) {
+		Debug( LDAP_DEBUG_ANY, "smbkrb5pwd: %s.\n", err, 0, 0 );
+		ldap_pvt_thread_mutex_destroy( &pi->krb5_mutex );
+		ch_free( pi );
+		return 1;
+	}
+	smbkrb5pwd_conf_publish( pi );
 
 	on->on_bi.bi_private = (void *)pi;
 
@@ -968,6 +6234,7 @@ smbkrb5pwd_db_open(BackendDB *be, ConfigReply *cr)
 
 	if ( pi->mode == 0 ) {
 		pi->mode = SMBKRB5PWD_F_ALL;
+		smbkrb5pwd_conf_publish( pi );
 	}
 
 	rc = smbkrb5pwd_modules_init( pi );
@@ -975,6 +6242,57 @@ smbkrb5pwd_db_open(BackendDB *be, ConfigReply *cr)
 		return rc;
 	}
 
+	if ( slapMode & SLAP_TOOL_MODE ) {
+		return 0;
+	}
+
+	pi->be = be;
+	/* resolving the admin principals may block on DNS, do it
+	 * in the background and let slapd start meanwhile */
+	smbkrb5pwd_realms_open( pi );
+
+	/* finish an interrupted re-stamping; finds nothing to do if
+	 * the entries already match the intervals */
+	if ( pi->restamp && SMBKRB5PWD_DO_SAMBA( pi ) ) {
+		smbkrb5pwd_restamp_schedule( pi );
+	}
+
+	if ( pi->cred_generation ) {
+		smbkrb5pwd_upgrade_schedule( pi );
+	}
+
+	if ( pi->krb5_inline && !pi->krb5_inline_basic ) {
+		Debug( LDAP_DEBUG_ANY, "smbkrb5pwd: "
+			"olcSmbKrb5PwdKrb5Inline has no effect without "
+			"olcSmbKrb5PwdKrb5InlineBasicChecks, "
+			"kerberos keys are changed through kadm5.\n", 0, 0, 0 );
+	}
+
+#ifdef SMBKRB5PWD_MONITOR
+	rc = smbkrb5pwd_monitor_db_open( be );
+	if ( rc ) {
+		return rc;
+	}
+#endif
+
+	return 0;
+}
+
+static int
+smbkrb5pwd_db_close(BackendDB *be, ConfigReply *cr)
+{
+	slap_overinst	*on = (slap_overinst *)be->bd_info;
+	smbkrb5pwd_t	*pi = (smbkrb5pwd_t *)on->on_bi.bi_private;
+
+	smbkrb5pwd_realms_close( pi );
+	smbkrb5pwd_restamp_cancel( pi );
+	smbkrb5pwd_upgrade_cancel( pi );
+	pi->be = NULL;
+
+#ifdef SMBKRB5PWD_MONITOR
+	smbkrb5pwd_monitor_db_close( be );
+#endif
+
 	return 0;
 }
 
@@ -985,6 +6303,21 @@ smbkrb5pwd_db_destroy(BackendDB *be, ConfigReply *cr)
 	smbkrb5pwd_t	*pi = (smbkrb5pwd_t *)on->on_bi.bi_private;
 
 	if ( pi ) {
+		int i;
+
+		for ( i = 0; i < pi->nrealm_maps; i++ )
+			smbkrb5pwd_realm_map_free( &pi->realm_maps[i] );
+		ch_free( pi->realm_maps );
+		ldap_pvt_thread_mutex_destroy( &pi->krb5_mutex );
+		ch_free( pi->kerberos_realm );
+		ch_free( pi->shadow_name );
+		ch_free( pi->shadow_server );
+		smbkrb5pwd_princ_free( pi->princ_map );
+		pi->dedupe_ttl = 0;
+		smbkrb5pwd_dedupe_reset( pi, 0 );
+		ch_free( pi->trace_file );
+		ch_free( pi->conf->trace_file );
+		ch_free( pi->conf );
 		ch_free( pi );
 	}
 
@@ -1000,8 +6333,10 @@ smbkrb5pwd_initialize(void)
 
 	smbkrb5pwd.on_bi.bi_db_init = smbkrb5pwd_db_init;
 	smbkrb5pwd.on_bi.bi_db_open = smbkrb5pwd_db_open;
+	smbkrb5pwd.on_bi.bi_db_close = smbkrb5pwd_db_close;
 	smbkrb5pwd.on_bi.bi_db_destroy = smbkrb5pwd_db_destroy;
 
+	smbkrb5pwd.on_bi.bi_op_bind = smbkrb5pwd_bind;
 	smbkrb5pwd.on_bi.bi_extended = smbkrb5pwd_exop_passwd;
 
 	smbkrb5pwd.on_bi.bi_cf_ocs = smbkrb5pwd_cfocs;
@@ -1011,6 +6346,31 @@ smbkrb5pwd_initialize(void)
 		return rc;
 	}
 
+	rc = register_at( smbkrb5pwd_cred_version_at,
+			  &ad_smbkrb5pwdCredVersion, 0 );
+	if ( rc ) {
+		Debug( LDAP_DEBUG_ANY, "smbkrb5pwd: "
+			"unable to register smbkrb5pwdCredVersion (%d).\n",
+			rc, 0, 0 );
+		return rc;
+	}
+
+	rc = load_extop2( (struct berval *)&smbkrb5pwd_exop_batch_oid,
+			  SLAP_EXOP_WRITES, smbkrb5pwd_batch_extop, 0 );
+	if ( rc ) {
+		Debug( LDAP_DEBUG_ANY, "smbkrb5pwd: "
+			"unable to register batch password modify"
+			" extended operation (%d).\n", rc, 0, 0 );
+		return rc;
+	}
+
+#ifdef SMBKRB5PWD_MONITOR
+	rc = smbkrb5pwd_monitor_initialize();
+	if ( rc ) {
+		return rc;
+	}
+#endif
+
 	return overlay_register( &smbkrb5pwd );
 }
 
@@ -0,0 +1,68 @@
+/* smbkrb5pwd_trace.h - Binary flight recorder records of smbkrb5pwd */
+/* This work is part of OpenLDAP Software <http://www.openldap.org/>.
+ *
+ * Copyright 2004-2009 The OpenLDAP Foundation.
+ * Other portions Copyright 2010 Opinsys.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+#ifndef SMBKRB5PWD_TRACE_H
+#define SMBKRB5PWD_TRACE_H
+
+#include <stdint.h>
+
+/* Every record in a trace file starts with this, "SKPT" */
+#define SMBKRB5PWD_TRACE_MAGIC	0x54504b53U
+
+/* Phases of a password change */
+#define SMBKRB5PWD_PH_EXOP		1	/* whole exop */
+#define SMBKRB5PWD_PH_ENTRY		2	/* be_entry_get_rw() */
+#define SMBKRB5PWD_PH_ACL		3	/* access_allowed() */
+#define SMBKRB5PWD_PH_KRB5		4	/* kerberos dispatch */
+#define SMBKRB5PWD_PH_KADM5_INIT	5
+#define SMBKRB5PWD_PH_KADM5_CREATE	6
+#define SMBKRB5PWD_PH_KADM5_CHPASS	7
+#define SMBKRB5PWD_PH_SAMBA		8	/* samba rs_mods, with nthash() */
+#define SMBKRB5PWD_PH_NTHASH		9
+#define SMBKRB5PWD_PH_MAX		9
+
+#define SMBKRB5PWD_PHASE_NAMES { \
+	"unknown", \
+	"exop", \
+	"entry", \
+	"acl", \
+	"krb5", \
+	"kadm5_init", \
+	"kadm5_create", \
+	"kadm5_chpass", \
+	"samba", \
+	"nthash", \
+}
+
+/* ev_flags */
+#define SMBKRB5PWD_EV_ERROR	0x0001U
+
+/* Fixed size, host byte order; the decoder must run on the same
+ * architecture as slapd. */
+typedef struct smbkrb5pwd_trace_event {
+	uint32_t	ev_magic;
+	uint16_t	ev_phase;
+	uint16_t	ev_flags;
+	uint64_t	ev_time;	/* end of the phase, ns since epoch */
+	uint64_t	ev_connid;
+	uint64_t	ev_opid;
+	int32_t		ev_kadm5;	/* kadm5/krb5 return code */
+	int32_t		ev_rc;		/* LDAP result code */
+	uint32_t	ev_duration;	/* microseconds */
+	uint32_t	ev_pid;
+} smbkrb5pwd_trace_event;
+
+#endif /* SMBKRB5PWD_TRACE_H */